@@ -16,6 +16,7 @@
 
 #include "utils/communication_types.h"
 #include "utils/communication_utils.h"
+#include "utils/buffer_pool_utils.h"
 
 // UI constants
 #define X_PRINT 8
@@ -24,11 +25,27 @@
 #define PORT 8989
 #define ADDRESS "127.0.0.1"
 
+#define CONVERSATION_PAGE_SIZE 10
+
+// The newest page of the open conversation. Refreshes only ask the server for the messages after the newest one held.
+typedef struct ConversationCache
+{
+    char *peer;
+    int messagesCount;
+    int rowsCount;
+    MessageStructure rows[CONVERSATION_PAGE_SIZE];
+} ConversationCache;
+
 // CLIENT variables
 int socketDescriptor;
+FrameBuffer responseBuffer;
+int binaryProtocol = 0;
+unsigned int nextRequestId = 1;
 WINDOW *window;
 char *loggedUsername = NULL;
 unsigned short int authorized = 0;
+ConversationCache conversationCache = {0};
+unsigned short int syncMessages = 1; // cleared when the server doesn't know Sync_Messages
 
 int Y_MAX, X_MAX;
 
@@ -45,39 +62,36 @@ int RenderSendMessageComponent(const char *selectedUser, const int replyId, cons
 int RenderViewMessageView(const struct MessageStructure messageObject, const char *selectedUser);
 
 // Helper Functions
+ProtocolField TextField(const char *text);
+ProtocolField NumberField(int number);
 char *CreatePrintRow(struct MessageStructure messageObject, int i);
 void ClearRows(int startRow, int endRow);
 
 // Communication functions
+int ConnectToServer();
+int NegotiateProtocol();
 unsigned short int ValidateUserInputs(const char *command, int length, char userInputs[][50]);
-ServerResponse SendRequest(char *request);
+ServerResponse SendRequest(const char *command, const ProtocolField *fields, int fieldsCount);
 ServerResponse SendLoginRequest(char userInputs[][50]);
 ServerResponse SendRegisterRequest(char userInputs[][50]);
-ServerResponse SendViewUsersRequest(int currentPage);
-ServerResponse SendViewMessagesRequest(int currentPage, const char *selectedUser);
+ServerResponse SendViewUsersAfterRequest(const char *afterUsername);
+ServerResponse SendViewMessagesBeforeRequest(int beforeId, const char *selectedUser);
 ServerResponse SendGetUsersCountRequest();
+ServerResponse SendLogoutRequest();
 ServerResponse SendGetMessagesCountRequest(const char *selectedUser);
 ServerResponse SendInsertMessageRequest(const char *selectedUser, const char *message, int replyId);
-ServerResponse SendUpdateMessageReadRequest(struct MessageStructure *messageObjects, int numOfMessages);
+ServerResponse SendMarkConversationReadRequest(const char *selectedUser, struct MessageStructure *messageObjects, int numOfMessages);
+ServerResponse SendSyncMessagesRequest(const char *selectedUser, int afterId);
+
+// Conversation cache functions
+ServerResponse LoadConversation(const char *selectedUser);
+void StoreConversationRows(ServerResponse *serverResponse, int keptRows);
+void ClearConversationCache();
 
 int main()
 {
-    struct sockaddr_in serverSocketStructure;
-
-    socketDescriptor = socket(AF_INET, SOCK_STREAM, 0);
-    if (socketDescriptor == -1)
+    if (NegotiateProtocol() != 0)
     {
-        printf("[CLIENT][ERROR] Socket creation error!\n");
-        return -1;
-    }
-
-    serverSocketStructure.sin_family = AF_INET;
-    serverSocketStructure.sin_port = htons(PORT);
-    serverSocketStructure.sin_addr.s_addr = inet_addr(ADDRESS);
-
-    if (connect(socketDescriptor, (struct sockaddr *)&serverSocketStructure, sizeof(struct sockaddr)) == -1)
-    {
-        printf("[CLIENT][ERROR] Error at connect()!\n");
         return -1;
     }
 
@@ -286,8 +300,10 @@ int RenderSecondPage()
 
         if (ch == 'L' || ch == 'l')
         {
+            SendLogoutRequest();
             authorized = 0;
             loggedUsername = NULL;
+            ClearConversationCache();
             return 0;
         }
 
@@ -330,6 +346,10 @@ char RenderViewUsersView()
     {
         int currentPage = 1;
 
+        // pageCursors[page] is the last username shown before that page
+        char **pageCursors = (char **)calloc(usersPages + 1, sizeof(char *));
+        pageCursors[1] = strdup("");
+
         do
         {
             wattron(window, COLOR_PAIR(2));
@@ -356,7 +376,7 @@ char RenderViewUsersView()
                 wattroff(window, COLOR_PAIR(1));
             }
 
-            ServerResponse viewUsersServerResponse = SendViewUsersRequest(currentPage);
+            ServerResponse viewUsersServerResponse = SendViewUsersAfterRequest(pageCursors[currentPage]);
             if (viewUsersServerResponse.status != 200)
             {
                 wattron(window, COLOR_PAIR(2));
@@ -365,20 +385,16 @@ char RenderViewUsersView()
                 wattroff(window, COLOR_PAIR(2));
 
                 wgetch(window);
+                FreeParsedStrings(pageCursors, usersPages + 1);
                 return -1;
             }
 
-            int numOfUsers = 0;
-            char **users = ParseContent(viewUsersServerResponse.content, &numOfUsers);
-
-            free(viewUsersServerResponse.content);
+            int numOfUsers = viewUsersServerResponse.rowsCount;
+            struct UserViewStructure *userObjects = viewUsersServerResponse.users;
 
             int user_Y_PRINT = Y_PRINT + 4;
-            struct UserViewStructure userObjects[numOfUsers];
             for (int i = 0; i < numOfUsers; i++)
             {
-                userObjects[i] = ParseUserViewStructure(users[i]);
-
                 int len = snprintf(NULL, 0, "[%d] %s [%d Unread Messages]", i,
                                    userObjects[i].username, userObjects[i].unreadMessagesCount);
                 if (len <= 0)
@@ -421,8 +437,10 @@ char RenderViewUsersView()
                         break;
                     }
 
-                    if ((ch == 'X' || ch == 'x') && currentPage < usersPages)
+                    if ((ch == 'X' || ch == 'x') && currentPage < usersPages && numOfUsers > 0)
                     {
+                        free(pageCursors[currentPage + 1]);
+                        pageCursors[currentPage + 1] = strdup(userObjects[numOfUsers - 1].username);
                         currentPage += 1;
                         break;
                     }
@@ -442,8 +460,10 @@ char RenderViewUsersView()
             }
 
             ClearRows(Y_PRINT + 4, Y_PRINT + 25);
-            FreeParsedStrings(users, numOfUsers);
+            FreeResponseRows(&viewUsersServerResponse);
         } while (ch != 'B' && ch != 'b' && ch != 'R' && ch != 'r');
+
+        FreeParsedStrings(pageCursors, usersPages + 1);
     }
     else
     {
@@ -479,22 +499,26 @@ char RenderSelectUserView(const char *selectedUser)
 
     mvwprintw(window, Y_PRINT, X_PRINT + 12, "Conversation View");
 
-    ServerResponse getMessageCountServerResponse = SendGetMessagesCountRequest(selectedUser);
-    if (getMessageCountServerResponse.status != 200)
+    ServerResponse loadConversationServerResponse = LoadConversation(selectedUser);
+    if (loadConversationServerResponse.status != 200)
     {
         wattron(window, COLOR_PAIR(2));
         mvwaddstr(window, Y_PRINT + 4, X_PRINT, "Press any button to return.");
-        mvwaddstr(window, Y_PRINT + 5, X_PRINT, getMessageCountServerResponse.content);
+        mvwaddstr(window, Y_PRINT + 5, X_PRINT, loadConversationServerResponse.content);
         wattroff(window, COLOR_PAIR(2));
 
         char ch = wgetch(window);
         return -1;
     }
 
-    int messagesCount = atoi(getMessageCountServerResponse.content);
+    int messagesCount = conversationCache.messagesCount;
     int messagesPages = messagesCount % 10 == 0 ? messagesCount / 10 : messagesCount / 10 + 1;
 
     int currentPage = 1;
+
+    // pageCursors[page] is the oldest message id shown before that page, 0 for the newest page
+    int *pageCursors = (int *)calloc(messagesPages + 2, sizeof(int));
+
     char ch;
     do
     {
@@ -527,7 +551,7 @@ char RenderSelectUserView(const char *selectedUser)
         }
 
         int numOfMessages = 0;
-        char **messages = NULL;
+        struct ServerResponse getMessagesServerResponse = {0};
         struct MessageStructure *messageObjects = NULL;
         if (messagesCount > 0)
         {
@@ -535,7 +559,15 @@ char RenderSelectUserView(const char *selectedUser)
             mvwaddstr(window, Y_PRINT + 3, X_PRINT, "Press message digit to view entire message");
             wattroff(window, COLOR_PAIR(1));
 
-            ServerResponse getMessagesServerResponse = SendViewMessagesRequest(currentPage, selectedUser);
+            // The newest page is the cached one, older pages are fetched
+            if (currentPage == 1)
+            {
+                getMessagesServerResponse.status = 200;
+            }
+            else
+            {
+                getMessagesServerResponse = SendViewMessagesBeforeRequest(pageCursors[currentPage], selectedUser);
+            }
             if (getMessagesServerResponse.status != 200)
             {
                 wattron(window, COLOR_PAIR(2));
@@ -544,18 +576,16 @@ char RenderSelectUserView(const char *selectedUser)
                 wattroff(window, COLOR_PAIR(2));
 
                 char ch = wgetch(window);
+                free(pageCursors);
                 return -1;
             }
 
-            messages = ParseContent(getMessagesServerResponse.content, &numOfMessages);
-            free(getMessagesServerResponse.content);
+            numOfMessages = currentPage == 1 ? conversationCache.rowsCount : getMessagesServerResponse.rowsCount;
+            messageObjects = currentPage == 1 ? conversationCache.rows : getMessagesServerResponse.messages;
 
-            messageObjects = (struct MessageStructure *)malloc(numOfMessages * sizeof(struct MessageStructure));
             int message_Y_PRINT = Y_PRINT + 5;
             for (int i = numOfMessages - 1; i >= 0; i--)
             {
-                messageObjects[i] = ParseMessage(messages[i]);
-
                 int len = snprintf(NULL, 0, "[%d][ID: %d] %s: %s", i, messageObjects[i].id,
                                    messageObjects[i].sender, messageObjects[i].message);
 
@@ -580,7 +610,7 @@ char RenderSelectUserView(const char *selectedUser)
                 message_Y_PRINT += 1;
             }
 
-            struct ServerResponse updateMessageReadServerResponse = SendUpdateMessageReadRequest(messageObjects, numOfMessages);
+            struct ServerResponse updateMessageReadServerResponse = SendMarkConversationReadRequest(selectedUser, messageObjects, numOfMessages);
             if (updateMessageReadServerResponse.status != 200)
             {
                 wattron(window, COLOR_PAIR(2));
@@ -591,6 +621,17 @@ char RenderSelectUserView(const char *selectedUser)
                 wgetch(window);
                 ClearRows(Y_PRINT + 3, Y_PRINT + 4);
             }
+            else if (currentPage == 1)
+            {
+                // The watermark now covers every received message of the page
+                for (int i = 0; i < numOfMessages; i++)
+                {
+                    if (strcmp(messageObjects[i].sender, loggedUsername) != 0)
+                    {
+                        messageObjects[i].read = 1;
+                    }
+                }
+            }
         }
 
         ch = wgetch(window);
@@ -633,8 +674,9 @@ char RenderSelectUserView(const char *selectedUser)
                     break;
                 }
 
-                if ((ch == 'X' || ch == 'x') && currentPage < messagesPages)
+                if ((ch == 'X' || ch == 'x') && currentPage < messagesPages && numOfMessages > 0)
                 {
+                    pageCursors[currentPage + 1] = messageObjects[numOfMessages - 1].id;
                     currentPage += 1;
                     break;
                 }
@@ -649,13 +691,11 @@ char RenderSelectUserView(const char *selectedUser)
         }
 
         ClearRows(Y_PRINT + 3, Y_PRINT + 25);
-        FreeParsedStrings(messages, numOfMessages);
-        if (messageObjects != NULL)
-        {
-            free(messageObjects);
-        }
+        FreeResponseRows(&getMessagesServerResponse);
     } while (ch != 'B' && ch != 'b');
 
+    free(pageCursors);
+
     return ch;
 }
 
@@ -768,6 +808,74 @@ int RenderSendMessageComponent(const char *selectedUser, const int replyId, cons
 }
 
 // Communication functions
+int ConnectToServer()
+{
+    struct sockaddr_in serverSocketStructure;
+
+    socketDescriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketDescriptor == -1)
+    {
+        printf("[CLIENT][ERROR] Socket creation error!\n");
+        return -1;
+    }
+
+    serverSocketStructure.sin_family = AF_INET;
+    serverSocketStructure.sin_port = htons(PORT);
+    serverSocketStructure.sin_addr.s_addr = inet_addr(ADDRESS);
+
+    if (connect(socketDescriptor, (struct sockaddr *)&serverSocketStructure, sizeof(struct sockaddr)) == -1)
+    {
+        printf("[CLIENT][ERROR] Error at connect()!\n");
+        close(socketDescriptor);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Offers the binary protocol; servers that don't answer with a binary HELLO are spoken to in framed text
+// on a new connection, since they may have already answered the HELLO bytes as a text request.
+int NegotiateProtocol()
+{
+    if (ConnectToServer() != 0)
+    {
+        return -1;
+    }
+
+    InitFrameBuffer(&responseBuffer, FRAME_MODE_UNKNOWN);
+
+    int helloLength;
+    char *hello = CreateBinaryRequest(OPCODE_HELLO, 0, nextRequestId++, NULL, 0, &helloLength);
+    if (hello != NULL && SendAll(socketDescriptor, hello, helloLength) == 0)
+    {
+        int responseLength;
+        char *response = ReceiveFrame(socketDescriptor, &responseBuffer, &responseLength);
+        if (response != NULL && responseBuffer.mode == FRAME_MODE_BINARY)
+        {
+            BinaryHeader header;
+            ParseBinaryHeader(response, &header);
+            binaryProtocol = header.opcode == OPCODE_HELLO && header.version == BINARY_PROTOCOL_VERSION;
+            ConsumeFrame(&responseBuffer);
+        }
+    }
+    ReturnBuffer(hello);
+
+    if (binaryProtocol)
+    {
+        return 0;
+    }
+
+    close(socketDescriptor);
+    FreeFrameBuffer(&responseBuffer);
+    if (ConnectToServer() != 0)
+    {
+        return -1;
+    }
+
+    InitFrameBuffer(&responseBuffer, FRAME_MODE_LENGTH_PREFIXED);
+    return 0;
+}
+
 unsigned short int ValidateUserInputs(const char *command, int length, char userInputs[][50])
 {
     for (int i = 0; i < length; i++)
@@ -778,7 +886,8 @@ unsigned short int ValidateUserInputs(const char *command, int length, char user
         }
 
         userInputs[i][strlen(userInputs[i])] = '\0';
-        if (strchr(userInputs[i], ':') != NULL || strchr(userInputs[i], '#') != NULL || strchr(userInputs[i], '|'))
+        // The username, first, is sent to text clients in list rows, so it never takes the delimiters
+        if ((i == 0 || !binaryProtocol) && (strchr(userInputs[i], ':') != NULL || strchr(userInputs[i], '#') != NULL || strchr(userInputs[i], '|')))
         {
             return 2;
         }
@@ -805,41 +914,65 @@ unsigned short int ValidateUserInputs(const char *command, int length, char user
     return 0;
 }
 
-ServerResponse SendRequest(char *request)
+ServerResponse SendRequest(const char *command, const ProtocolField *fields, int fieldsCount)
 {
-    char serverResponse[8192];
-    memset(serverResponse, 0, 8192);
+    int commandNumber = RetrieveCommandNumber(command);
+
+    OutputBuffer output;
+    InitOutputBuffer(&output, OUTPUT_BUFFER_SIZE);
+    if (binaryProtocol)
+    {
+        AppendBinaryRequest(&output, commandNumber, authorized, nextRequestId++, fields, fieldsCount);
+    }
+    else
+    {
+        int frameStart = BeginFrame(&output);
+        AppendTextRequest(&output, command, authorized, fields, fieldsCount);
+        EndFrame(&output, frameStart);
+    }
+
+    int requestLength;
+    char *request = DetachOutputBuffer(&output, &requestLength);
 
-    if (send(socketDescriptor, request, strlen(request), 0) <= 0)
+    if (request == NULL || SendAll(socketDescriptor, request, requestLength) != 0)
     {
-        struct ServerResponse errorResponse;
+        struct ServerResponse errorResponse = {0};
         errorResponse.status = 400;
         errorResponse.content = "[CLIENT][ERROR] Error at send()!\n";
 
-        free(request);
+        ReturnBuffer(request);
         return errorResponse;
     }
+    ReturnBuffer(request);
 
-    ssize_t noOfBytesRead = recv(socketDescriptor, serverResponse, 8192, 0);
-    if (noOfBytesRead < 0)
+    int serverResponseLength;
+    char *serverResponse = ReceiveFrame(socketDescriptor, &responseBuffer, &serverResponseLength);
+    if (serverResponse == NULL && serverResponseLength == -1)
     {
-        struct ServerResponse errorResponse;
+        struct ServerResponse errorResponse = {0};
         errorResponse.status = 400;
         errorResponse.content = "[CLIENT][ERROR] Error at recv()!\n";
 
-        free(request);
         return errorResponse;
     }
-    else if (noOfBytesRead == 0)
+    else if (serverResponse == NULL)
     {
         exit(0);
     }
-    else if (noOfBytesRead > 0)
+
+    struct ServerResponse responseStructure;
+    if (binaryProtocol)
     {
-        struct ServerResponse responseStructure = ParseServerResponse(serverResponse);
-        free(request);
-        return responseStructure;
+        responseStructure = ParseBinaryServerResponse(serverResponse, serverResponseLength);
     }
+    else
+    {
+        responseStructure = ParseServerResponse(serverResponse);
+        ParseResponseRows(&responseStructure, commandNumber);
+    }
+
+    ConsumeFrame(&responseBuffer);
+    return responseStructure;
 }
 
 ServerResponse SendLoginRequest(char userInputs[][50])
@@ -847,7 +980,7 @@ ServerResponse SendLoginRequest(char userInputs[][50])
     unsigned short int validationCode = ValidateUserInputs("Login", 2, userInputs);
     if (validationCode != 0)
     {
-        struct ServerResponse errorResponse;
+        struct ServerResponse errorResponse = {0};
         errorResponse.status = 0;
 
         switch (validationCode)
@@ -863,24 +996,8 @@ ServerResponse SendLoginRequest(char userInputs[][50])
         return errorResponse;
     }
 
-    char *content = NULL;
-    int len = snprintf(NULL, 0, "%s#%s#", userInputs[0], userInputs[1]);
-
-    if (len <= 0)
-    {
-        struct ServerResponse errorResponse;
-        errorResponse.status = 400;
-        errorResponse.content = "Unrecognized inputs error\n";
-        return errorResponse;
-    }
-
-    content = (char *)malloc(len + 1);
-    snprintf(content, len + 1, "%s#%s#", userInputs[0], userInputs[1]);
-
-    char *clientRequest = CreateClientRequest("Login", content, authorized);
-
-    free(content);
-    return SendRequest(clientRequest);
+    ProtocolField fields[] = {TextField(userInputs[0]), TextField(userInputs[1])};
+    return SendRequest("Login", fields, 2);
 }
 
 ServerResponse SendRegisterRequest(char userInputs[][50])
@@ -888,7 +1005,7 @@ ServerResponse SendRegisterRequest(char userInputs[][50])
     unsigned short int validationCode = ValidateUserInputs("Register", 5, userInputs);
     if (validationCode != 0)
     {
-        struct ServerResponse errorResponse;
+        struct ServerResponse errorResponse = {0};
         errorResponse.status = 0;
 
         switch (validationCode)
@@ -909,212 +1026,236 @@ ServerResponse SendRegisterRequest(char userInputs[][50])
         return errorResponse;
     }
 
-    char *content = NULL;
-    int len = snprintf(NULL, 0, "%s#%s#%s#%s#%s#",
-                       userInputs[0], userInputs[1], userInputs[2], userInputs[3], userInputs[4]);
-
-    if (len <= 0)
-    {
-        struct ServerResponse errorResponse;
-        errorResponse.status = 0;
-        errorResponse.content = "Client Internal Error";
-        return errorResponse;
-    }
-
-    content = (char *)malloc(len + 1);
-    snprintf(content, len + 1, "%s#%s#%s#%s#%s#",
-             userInputs[0], userInputs[1], userInputs[2], userInputs[3], userInputs[4]);
-
-    char *clientRequest = CreateClientRequest("Register", content, authorized);
-
-    free(content);
-    return SendRequest(clientRequest);
+    ProtocolField fields[] = {TextField(userInputs[0]), TextField(userInputs[1]), TextField(userInputs[2]),
+                              TextField(userInputs[3]), TextField(userInputs[4])};
+    return SendRequest("Register", fields, 5);
 }
 
-ServerResponse SendViewUsersRequest(int currentPage)
+// The server knows the logged user from the connection's session, requests only carry the other user.
+// Pages are requested by cursor: the last username already shown, "" for the first page
+ServerResponse SendViewUsersAfterRequest(const char *afterUsername)
 {
-    char *content = NULL;
-    int len = snprintf(NULL, 0, "%s#%d#", loggedUsername, currentPage);
-
-    if (len <= 0)
-    {
-        struct ServerResponse errorResponse;
-        errorResponse.status = 0;
-        errorResponse.content = "Client Internal Error";
-        return errorResponse;
-    }
-
-    content = (char *)malloc(len + 1);
-    snprintf(content, len + 1, "%s#%d#", loggedUsername, currentPage);
-
-    char *clientRequest = CreateClientRequest("View_Users", content, authorized);
-
-    free(content);
-    return SendRequest(clientRequest);
+    ProtocolField fields[] = {TextField(afterUsername)};
+    return SendRequest("View_Users_After", fields, 1);
 }
 
-ServerResponse SendViewMessagesRequest(int currentPage, const char *selectedUser)
+// Pages are requested by cursor: the oldest message id already shown, 0 for the newest page
+ServerResponse SendViewMessagesBeforeRequest(int beforeId, const char *selectedUser)
 {
-    char *content = NULL;
-    int len = snprintf(NULL, 0, "%s#%s#%d#", loggedUsername, selectedUser, currentPage);
-
-    if (len <= 0)
-    {
-        struct ServerResponse errorResponse;
-        errorResponse.status = 0;
-        errorResponse.content = "Client Internal Error";
-        return errorResponse;
-    }
-
-    content = (char *)malloc(len + 1);
-    snprintf(content, len + 1, "%s#%s#%d#", loggedUsername, selectedUser, currentPage);
-
-    char *clientRequest = CreateClientRequest("View_Messages", content, authorized);
-
-    free(content);
-    return SendRequest(clientRequest);
+    ProtocolField fields[] = {TextField(selectedUser), NumberField(beforeId)};
+    return SendRequest("View_Messages_Before", fields, 2);
 }
 
 ServerResponse SendGetMessagesCountRequest(const char *selectedUser)
 {
-    char *content = NULL;
-    int len = snprintf(NULL, 0, "%s#%s#", loggedUsername, selectedUser);
-
-    if (len <= 0)
-    {
-        struct ServerResponse errorResponse;
-        errorResponse.status = 0;
-        errorResponse.content = "Client Internal Error";
-        return errorResponse;
-    }
-
-    content = (char *)malloc(len + 1);
-    snprintf(content, len + 1, "%s#%s#", loggedUsername, selectedUser);
-
-    char *clientRequest = CreateClientRequest("Get_Messages_Count", content, authorized);
-
-    free(content);
-    return SendRequest(clientRequest);
+    ProtocolField fields[] = {TextField(selectedUser)};
+    return SendRequest("Get_Messages_Count", fields, 1);
 }
 
 ServerResponse SendGetUsersCountRequest()
 {
-    char *content = NULL;
-    int len = snprintf(NULL, 0, "%s", loggedUsername);
-
-    if (len <= 0)
-    {
-        struct ServerResponse errorResponse;
-        errorResponse.status = 0;
-        errorResponse.content = "Client Internal Error";
-        return errorResponse;
-    }
-
-    content = (char *)malloc(len + 1);
-    snprintf(content, len + 1, "%s", loggedUsername);
-
-    char *clientRequest = CreateClientRequest("Get_Users_Count", content, authorized);
+    return SendRequest("Get_Users_Count", NULL, 0);
+}
 
-    free(content);
-    return SendRequest(clientRequest);
+ServerResponse SendLogoutRequest()
+{
+    return SendRequest("Logout", NULL, 0);
 }
 
 ServerResponse SendInsertMessageRequest(const char *selectedUser, const char *message, int replyId)
 {
     if (message == NULL || strlen(message) == 0)
     {
-        struct ServerResponse errorResponse;
+        struct ServerResponse errorResponse = {0};
         errorResponse.status = 0;
         errorResponse.content = "The inputs should not be empty.";
 
         return errorResponse;
     }
 
-    if (strchr(message, ':') != NULL || strchr(message, '#') != NULL || strchr(message, '|'))
+    if (!binaryProtocol && (strchr(message, ':') != NULL || strchr(message, '#') != NULL || strchr(message, '|')))
     {
-        struct ServerResponse errorResponse;
+        struct ServerResponse errorResponse = {0};
         errorResponse.status = 0;
         errorResponse.content = "The inputs should not contain \":\", \"|\" or \"#\".";
 
         return errorResponse;
     }
 
-    char *content = NULL;
-    int len = snprintf(NULL, 0, "%s#%s#%s#%d#", loggedUsername, selectedUser, message, replyId);
+    ProtocolField fields[] = {TextField(selectedUser), TextField(message), NumberField(replyId)};
+    return SendRequest("Insert_Message", fields, 3);
+}
 
-    if (len <= 0)
+ServerResponse SendMarkConversationReadRequest(const char *selectedUser, struct MessageStructure *messageObjects, int numOfMessages)
+{
+    // The newest unread message received moves the read watermark of the whole conversation
+    int lastReadId = 0;
+    for (int i = 0; i < numOfMessages; i++)
     {
-        struct ServerResponse errorResponse;
-        errorResponse.status = 0;
-        errorResponse.content = "Client Internal Error";
-        return errorResponse;
+        if (messageObjects[i].read == 0 && strcmp(messageObjects[i].sender, loggedUsername) != 0 && messageObjects[i].id > lastReadId)
+        {
+            lastReadId = messageObjects[i].id;
+        }
     }
 
-    content = (char *)malloc(len + 1);
-    snprintf(content, len + 1, "%s#%s#%s#%d#", loggedUsername, selectedUser, message, replyId);
+    if (lastReadId == 0)
+    {
+        struct ServerResponse serverResponse = {0};
+        serverResponse.status = 200;
+        serverResponse.content = "No message to update";
+        return serverResponse;
+    }
 
-    char *clientRequest = CreateClientRequest("Insert_Message", content, authorized);
+    ProtocolField fields[] = {TextField(selectedUser), NumberField(lastReadId)};
+    return SendRequest("Mark_Conversation_Read", fields, 2);
+}
 
-    free(content);
-    return SendRequest(clientRequest);
+// Asks for the messages with an id greater than afterId, along with the messages count and both read watermarks
+ServerResponse SendSyncMessagesRequest(const char *selectedUser, int afterId)
+{
+    ProtocolField fields[] = {TextField(selectedUser), NumberField(afterId)};
+    return SendRequest("Sync_Messages", fields, 2);
 }
 
-ServerResponse SendUpdateMessageReadRequest(struct MessageStructure *messageObjects, int numOfMessages)
+// Conversation cache functions
+// Brings the cached newest page of the conversation up to date, returns the failed response on errors.
+// Servers without Sync_Messages get the messages count and the whole page instead.
+ServerResponse LoadConversation(const char *selectedUser)
 {
-    int contentLength = 0;
-    for (int i = 0; i < numOfMessages; i++)
+    struct ServerResponse serverResponse = {0};
+
+    if (conversationCache.peer == NULL || strcmp(conversationCache.peer, selectedUser) != 0)
     {
-        if (messageObjects[i].read == 0 && strcmp(messageObjects[i].sender, loggedUsername) != 0)
+        ClearConversationCache();
+        conversationCache.peer = strdup(selectedUser);
+        if (conversationCache.peer == NULL)
         {
-            int rowLength = snprintf(NULL, 0, "%d#", messageObjects[i].id);
-            if (rowLength <= 0)
+            serverResponse.status = 400;
+            serverResponse.content = "[CLIENT][ERROR] Error at strdup()!";
+            return serverResponse;
+        }
+    }
+
+    if (syncMessages)
+    {
+        int lastId = conversationCache.rowsCount > 0 ? conversationCache.rows[0].id : 0;
+        serverResponse = SendSyncMessagesRequest(selectedUser, lastId);
+        if (serverResponse.status == 200 && serverResponse.sync != NULL)
+        {
+            SyncState state = *serverResponse.sync;
+            StoreConversationRows(&serverResponse, CONVERSATION_PAGE_SIZE - serverResponse.rowsCount);
+            conversationCache.messagesCount = state.messagesCount;
+
+            // A received message is read up to the logged user's watermark, a sent one up to the peer's
+            for (int i = 0; i < conversationCache.rowsCount; i++)
             {
-                struct ServerResponse errorResponse;
-                errorResponse.status = 0;
-                errorResponse.content = "Client Internal Error";
-                return errorResponse;
+                MessageStructure *message = &conversationCache.rows[i];
+                int watermark = strcmp(message->sender, loggedUsername) != 0 ? state.readWatermark : state.peerReadWatermark;
+                message->read = message->id <= watermark;
             }
-            contentLength += rowLength;
+
+            return serverResponse;
         }
+
+        if (serverResponse.status != 400 || serverResponse.content == NULL || strcmp(serverResponse.content, "Bad request.") != 0)
+        {
+            return serverResponse;
+        }
+        syncMessages = 0;
     }
 
-    if (contentLength == 0)
+    serverResponse = SendGetMessagesCountRequest(selectedUser);
+    if (serverResponse.status != 200)
     {
-        struct ServerResponse serverResponse;
-        serverResponse.status = 200;
-        serverResponse.content = "No message to update";
         return serverResponse;
     }
+    int messagesCount = atoi(serverResponse.content);
 
-    char *content = (char *)malloc(contentLength + 1);
-    if (content == NULL)
+    struct ServerResponse getMessagesServerResponse = {0};
+    getMessagesServerResponse.status = 200;
+    if (messagesCount > 0)
     {
-        struct ServerResponse errorResponse;
-        errorResponse.status = 0;
-        errorResponse.content = "Client Internal Error";
-        return errorResponse;
+        getMessagesServerResponse = SendViewMessagesBeforeRequest(0, selectedUser);
+        if (getMessagesServerResponse.status != 200)
+        {
+            return getMessagesServerResponse;
+        }
     }
+    StoreConversationRows(&getMessagesServerResponse, 0);
+    conversationCache.messagesCount = messagesCount;
 
-    int offset = 0;
-    for (int i = 0; i < numOfMessages; i++)
+    return serverResponse;
+}
+
+// Moves the rows of a response in front of the first keptRows cached ones, the older cached rows are dropped.
+void StoreConversationRows(ServerResponse *serverResponse, int keptRows)
+{
+    int newRows = serverResponse->messages == NULL ? 0 : serverResponse->rowsCount;
+    if (newRows > CONVERSATION_PAGE_SIZE)
     {
-        if (messageObjects[i].read == 0 && strcmp(messageObjects[i].sender, loggedUsername) != 0)
-        {
-            offset += snprintf((content + offset), contentLength - offset + 1, "%d#", messageObjects[i].id);
-            if (offset <= 0)
-            {
-                struct ServerResponse errorResponse;
-                errorResponse.status = 0;
-                errorResponse.content = "Client Internal Error";
-                return errorResponse;
-            }
-        }
+        newRows = CONVERSATION_PAGE_SIZE;
+    }
+    if (keptRows > conversationCache.rowsCount)
+    {
+        keptRows = conversationCache.rowsCount;
+    }
+    if (keptRows > CONVERSATION_PAGE_SIZE - newRows)
+    {
+        keptRows = CONVERSATION_PAGE_SIZE - newRows;
+    }
+
+    for (int i = keptRows; i < conversationCache.rowsCount; i++)
+    {
+        free(conversationCache.rows[i].sender);
+        free(conversationCache.rows[i].message);
     }
 
-    char *clientRequest = CreateClientRequest("Update_Message_Read", content, authorized);
+    memmove(&conversationCache.rows[newRows], &conversationCache.rows[0], keptRows * sizeof(MessageStructure));
+    if (newRows > 0)
+    {
+        memcpy(&conversationCache.rows[0], serverResponse->messages, newRows * sizeof(MessageStructure));
+
+        // The moved rows belong to the cache now, FreeResponseRows only frees the rest
+        memmove(&serverResponse->messages[0], &serverResponse->messages[newRows],
+                (serverResponse->rowsCount - newRows) * sizeof(MessageStructure));
+        serverResponse->rowsCount -= newRows;
+    }
+    conversationCache.rowsCount = newRows + keptRows;
 
-    free(content);
-    return SendRequest(clientRequest);
+    FreeResponseRows(serverResponse);
+}
+
+void ClearConversationCache()
+{
+    for (int i = 0; i < conversationCache.rowsCount; i++)
+    {
+        free(conversationCache.rows[i].sender);
+        free(conversationCache.rows[i].message);
+    }
+
+    free(conversationCache.peer);
+    conversationCache.peer = NULL;
+    conversationCache.messagesCount = 0;
+    conversationCache.rowsCount = 0;
+}
+
+// Helper Functions
+ProtocolField TextField(const char *text)
+{
+    ProtocolField field;
+    field.data = text;
+    field.length = strlen(text);
+    field.number = 0;
+    return field;
+}
+
+ProtocolField NumberField(int number)
+{
+    ProtocolField field;
+    field.data = NULL;
+    field.length = 4;
+    field.number = number;
+    return field;
 }
 
 // Helper Functions
@@ -8,61 +8,161 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sys/resource.h>
 
 // #include "sql/sqlite3.h"
 #include "utils/communication_types.h"
 #include "utils/communication_utils.h"
 
 #include "utils/database_utils.h"
-
-typedef struct threadData
-{
-    int threadID;
-    int threadClient;
-} threadData;
+#include "utils/connection_utils.h"
+#include "utils/event_loop_utils.h"
+#include "utils/io_uring_utils.h"
+#include "utils/thread_pool_utils.h"
+#include "utils/write_queue_utils.h"
+#include "utils/user_directory_utils.h"
+#include "utils/log_utils.h"
+#include "utils/buffer_pool_utils.h"
+#include "utils/page_cache_utils.h"
 
 // SOCKET constants
 #define PORT 8989
 #define ADDRESS "127.0.0.1"
 
+// SERVER modes
+#define MODE_THREADS 0
+#define MODE_EPOLL 1
+#define MODE_IO_URING 2
+
+typedef struct ServerConfig
+{
+    int mode;
+    int loopsCount;
+    int workersCount;
+    int queueCapacity;
+    int shardListeners;
+    int backlog;
+} ServerConfig;
+
+typedef struct ThreadRequestState
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t completed;
+    char *response;
+    int responseLength;
+    int done;
+} ThreadRequestState;
+
 #define FILENAME_FOLDER "logs/"
 #define DATABASE_NAME "Offline_Messenger_DB.db"
 
+// Group commit limits for the message writer
+#define WRITE_BATCH_SIZE 64
+#define WRITE_BATCH_DELAY_US 1000
+
+// How often the logger thread writes the queued events to the log file
+#define LOG_FLUSH_INTERVAL_US 10000
+
+// Page cache
+#define PAGE_CACHE_SLOTS 4096
+
+// Status of a response answered later, once its write is committed
+#define STATUS_PENDING 0
+
 char *FILE_NAME;
-sqlite3 *DB;
+DatabasePool *DB;
+ThreadPool *WORKERS;
+WriteQueue *WRITES;
+UserDirectory *USERS;
+Logger *LOGS;
+PageCache *PAGES;
 
-pthread_mutex_t fileMutex = PTHREAD_MUTEX_INITIALIZER;
-static void *treat(void *);
+// Memory of the request a thread is answering, released in one step once its response is encoded
+static __thread Arena requestArena;
 
-char *ProcessClientRequest(const int clientId, ClientRequest requestStructure);
-ServerResponse ProccesLoginRequest(const int clientId, ClientRequest clientRequest);
-ServerResponse ProccesRegisterRequest(const int clientId, ClientRequest clientRequest);
-ServerResponse ProcessViewUsersRequest(const int clientId, ClientRequest clientRequest);
-ServerResponse ProccesViewMessagesRequest(const int clientId, ClientRequest clientRequest);
-ServerResponse ProcessGetUsersCountRequest(const int clientId, ClientRequest clientRequest);
-ServerResponse ProcessGetMessagesCountRequest(const int clientId, ClientRequest clientRequest);
-ServerResponse ProcessInsertMessageRequest(const int clientId, ClientRequest clientRequest);
-ServerResponse ProccesUpdateMessageReadRequest(const int clientId, ClientRequest clientRequest);
+static void *AcceptClients(void *);
+static void *treat(void *);
 
-char *PrepareUsersViewContent(const char **rows, const int *counts, int rowsCount);
-char *PrepareViewContent(const char **rows, int rowsCount);
+int ParseServerConfig(int argc, char *argv[], ServerConfig *config);
+int CreateListenSocket(int backlog);
+void RaiseOpenFilesLimit();
+
+void OnClientConnected(Connection *connection);
+int HandleClientRequest(Connection *connection, char *request, int requestLength);
+void OnClientDisconnected(Connection *connection);
+void RunRequestJob(void *arg);
+void DeliverResponse(Connection *connection, const BinaryHeader *header, ServerResponse response);
+void CompleteThreadRequest(Connection *connection, char *response, int responseLength);
+
+ServerResponse ProcessClientRequest(Connection *connection);
+ServerResponse ProccesLoginRequest(const int clientId, Session *session, const RequestFields *request);
+ServerResponse ProccesRegisterRequest(const int clientId, Session *session, const RequestFields *request);
+ServerResponse ProcessViewUsersRequest(const int clientId, const Session *session, const RequestFields *request);
+ServerResponse ProccesViewMessagesRequest(const int clientId, const Session *session, const RequestFields *request);
+ServerResponse ProcessGetUsersCountRequest(const int clientId, const Session *session, const RequestFields *request);
+ServerResponse ProcessGetMessagesCountRequest(const int clientId, const Session *session, const RequestFields *request);
+ServerResponse ProcessInsertMessageRequest(Connection *connection);
+void CompleteInsertMessage(void *context, const QueuedMessage *message);
+ServerResponse ProccesUpdateMessageReadRequest(const int clientId, const Session *session, const RequestFields *request);
+ServerResponse ProcessMarkConversationReadRequest(const int clientId, const Session *session, const RequestFields *request);
+ServerResponse ProcessGetCacheStatsRequest(const int clientId, const Session *session, const RequestFields *request);
+ServerResponse ProcessSyncMessagesRequest(const int clientId, const Session *session, const RequestFields *request);
+
+int SessionFieldsOffset(const Session *session, const RequestFields *request, int fieldsCount);
+
+int NameMessageSenders(MessageStructure *messages, int messagesCount);
 
 int FileExists(const char *filename);
 int CreateFile();
 
 void LogEvent(int clientId, const char *event);
-void LogRequestEvent(int clientId, const ClientRequest clientRequestStructure);
+void LogRequestEvent(int clientId, const RequestFields *request);
 void LogResponseEvent(int clientId, const ServerResponse serverResponseStructure);
 
-int main()
+int main(int argc, char *argv[])
 {
+    ServerConfig config;
+    if (ParseServerConfig(argc, argv, &config) != 0)
+    {
+        printf("Usage: %s [-m threads|epoll|uring] [-l event loops count] [-w workers count] [-q queue capacity] "
+               "[-s] [-b listen backlog]\n",
+               argv[0]);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    RaiseOpenFilesLimit();
+
+    sqlite3 *database = NULL;
+    int openResult;
     if (FileExists(DATABASE_NAME))
     {
-        OpenDatabase(&DB, DATABASE_NAME);
+        openResult = OpenDatabase(&database, DATABASE_NAME);
     }
     else
     {
-        CreateDatabase(&DB, DATABASE_NAME);
+        openResult = CreateDatabase(&database, DATABASE_NAME);
+    }
+
+    DB = openResult == 0 ? CreateDatabasePool(database, DATABASE_NAME, config.workersCount) : NULL;
+    if (DB == NULL)
+    {
+        printf("[SERVER][ERROR] Error at open database!\n");
+        return -1;
+    }
+
+    USERS = CreateUserDirectory();
+    if (USERS == NULL || LoadUserDirectory(DB->writer, USERS) != 0)
+    {
+        printf("[SERVER][ERROR] Error at load users!\n");
+        return -1;
+    }
+
+    PAGES = CreatePageCache(PAGE_CACHE_SLOTS);
+    if (PAGES == NULL)
+    {
+        printf("[SERVER][ERROR] Error at create page cache!\n");
+        return -1;
     }
 
     int createLogFileFlag = CreateFile();
@@ -72,19 +172,84 @@ int main()
         return -1;
     }
 
-    struct sockaddr_in serverSocketStructure;
-    struct sockaddr_in clientSocketStructure;
+    WORKERS = CreateThreadPool(config.workersCount, config.queueCapacity);
+    if (WORKERS == NULL)
+    {
+        printf("[SERVER][ERROR] Error at create worker pool!\n");
+        return -1;
+    }
+
+    WRITES = CreateWriteQueue(DB->writer, config.queueCapacity, WRITE_BATCH_SIZE, WRITE_BATCH_DELAY_US);
+    if (WRITES == NULL)
+    {
+        printf("[SERVER][ERROR] Error at create write queue!\n");
+        return -1;
+    }
+
+    int listenersCount = config.shardListeners ? config.loopsCount : 1;
+    int *listenSockets = (int *)malloc(config.loopsCount * sizeof(int));
+    for (int i = 0; i < config.loopsCount; i++)
+    {
+        listenSockets[i] = i < listenersCount ? CreateListenSocket(config.backlog) : listenSockets[0];
+        if (listenSockets[i] == -1)
+        {
+            return -1;
+        }
+    }
 
-    int socketDescriptor;
-    pthread_t threads[100];
+    EventLoopCallbacks callbacks = {&OnClientConnected, &HandleClientRequest, &OnClientDisconnected};
+    if (config.mode == MODE_IO_URING)
+    {
+        IoUringLoop *loops = CreateIoUringLoops(listenSockets, config.loopsCount, callbacks);
+        if (loops != NULL)
+        {
+            printf("[SERVER] Running %d io_uring loops on %d listeners at PORT %d.\n", config.loopsCount, listenersCount, PORT);
+            fflush(stdout);
+
+            return RunIoUringLoops(loops, config.loopsCount);
+        }
+
+        printf("[SERVER] io_uring is not available, falling back to one thread per client.\n");
+        fflush(stdout);
+    }
 
-    socketDescriptor = socket(AF_INET, SOCK_STREAM, 0);
+    if (config.mode == MODE_EPOLL)
+    {
+        printf("[SERVER] Running %d event loops on %d listeners at PORT %d.\n", config.loopsCount, listenersCount, PORT);
+        fflush(stdout);
+
+        return RunEventLoops(listenSockets, config.loopsCount, callbacks);
+    }
+
+    for (int i = 1; i < listenersCount; i++)
+    {
+        pthread_t thread;
+        int threadCreationResult = pthread_create(&thread, NULL, &AcceptClients, &listenSockets[i]);
+        if (threadCreationResult != 0)
+        {
+            fprintf(stderr, "[SERVER][ERROR] Failed to create accept thread: %s\n", strerror(threadCreationResult));
+            return -1;
+        }
+    }
+
+    AcceptClients(&listenSockets[0]);
+    return 0;
+}
+
+// With SO_REUSEPORT every call opens another listener on the same port and the kernel spreads
+// new connections between them.
+int CreateListenSocket(int backlog)
+{
+    struct sockaddr_in serverSocketStructure;
+
+    int socketDescriptor = socket(AF_INET, SOCK_STREAM, 0);
     if (socketDescriptor == -1)
     {
         printf("[SERVER][ERROR] Socket creation error!\n");
         return -1;
     }
 
+    memset(&serverSocketStructure, 0, sizeof(serverSocketStructure));
     serverSocketStructure.sin_family = AF_INET;
     serverSocketStructure.sin_port = htons(PORT);
     serverSocketStructure.sin_addr.s_addr = inet_addr(ADDRESS);
@@ -93,33 +258,45 @@ int main()
     if (setsockopt(socketDescriptor, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse)) < 0)
     {
         printf("[SERVER][ERROR] Error at set socket options (SO_REUSEADDR)!\n");
+        close(socketDescriptor);
         return -1;
     }
 
     if (setsockopt(socketDescriptor, SOL_SOCKET, SO_REUSEPORT, (const char *)&reuse, sizeof(reuse)) < 0)
     {
         printf("[SERVER][ERROR] Error at set socket options (SO_REUSEPORT)!\n");
+        close(socketDescriptor);
         return -1;
     }
 
     if (bind(socketDescriptor, (struct sockaddr *)&serverSocketStructure, sizeof(struct sockaddr)) == -1)
     {
         printf("[SERVER][ERROR] Error at bind!\n");
+        close(socketDescriptor);
         return -1;
     }
 
-    if (listen(socketDescriptor, 2) == -1)
+    if (listen(socketDescriptor, backlog) == -1)
     {
         printf("[SERVER][ERROR]  Error at listen().\n");
+        close(socketDescriptor);
         return -1;
     }
 
-    int clientId = 0;
+    return socketDescriptor;
+}
+
+// Thread per client mode: one accept loop per listener
+static void *AcceptClients(void *arg)
+{
+    int socketDescriptor = *(int *)arg;
+    struct sockaddr_in clientSocketStructure;
+
     while (1)
     {
         int client;
-        threadData *td;
-        int length = sizeof(clientSocketStructure);
+        pthread_t thread;
+        socklen_t length = sizeof(clientSocketStructure);
 
         printf("[SERVER] Waiting at PORT %d.\n", PORT);
         fflush(stdout);
@@ -131,106 +308,268 @@ int main()
             continue;
         }
 
-        printf("[SERVER] Client %d is accepted.\n", clientId);
+        Connection *connection = CreateConnection(client);
+        if (connection == NULL)
+        {
+            close(client);
+            continue;
+        }
 
-        td = (struct threadData *)malloc(sizeof(struct threadData));
-        td->threadID = clientId;
-        td->threadClient = client;
+        printf("[SERVER] Client %d is accepted.\n", connection->clientId);
 
-        int threadCreationResult = pthread_create(&threads[clientId], NULL, &treat, td);
+        int threadCreationResult = pthread_create(&thread, NULL, &treat, connection);
         if (threadCreationResult != 0)
         {
             fprintf(stderr, "[SERVER][ERROR] Failed to create thread: %s\n", strerror(threadCreationResult));
+            FreeConnection(connection);
         }
-        clientId++;
     }
+
+    return NULL;
 }
 
 static void *treat(void *arg)
 {
-    int quit = 0;
-
-    struct threadData *tdL;
-    tdL = (struct threadData *)arg;
+    Connection *connection = (Connection *)arg;
 
     pthread_detach(pthread_self());
 
-    LogEvent(tdL->threadID, "Client connected");
+    ThreadRequestState state;
+    pthread_mutex_init(&state.mutex, NULL);
+    pthread_cond_init(&state.completed, NULL);
+    state.response = NULL;
+    state.done = 0;
+
+    connection->owner = &state;
+    connection->complete = &CompleteThreadRequest;
+
+    OnClientConnected(connection);
 
-    char clientRequest[8192];
-    char *serverResponse = NULL;
-    while (!quit)
+    while (1)
     {
-        while (1)
+        int requestLength;
+        char *clientRequest = ReceiveFrame(connection->socket, &connection->input, &requestLength);
+        if (clientRequest == NULL)
         {
-            ssize_t noOfBytesRead = recv(tdL->threadClient, clientRequest, 8192, 0);
-            if (noOfBytesRead == -1)
+            if (requestLength == -1)
             {
-                printf("[SERVER][ERROR][Client %d] Error at recv().\n", tdL->threadID);
+                printf("[SERVER][ERROR][Client %d] Error at recv().\n", connection->clientId);
                 fflush(stdout);
-                serverResponse = CreateServerResponse(500, "Error at recv().");
-                break;
-            }
-            else if (noOfBytesRead == 0)
-            {
-                LogEvent(tdL->threadID, "Client disconnected");
-                quit = 1;
-                break;
             }
-            clientRequest[noOfBytesRead] = '\0';
-
-            struct ClientRequest requestStructure = ParseClientRequest(clientRequest);
-            LogRequestEvent(tdL->threadID, requestStructure);
+            break;
+        }
 
-            serverResponse = ProcessClientRequest(tdL->threadID, requestStructure);
+        HandleClientRequest(connection, clientRequest, requestLength);
 
+        pthread_mutex_lock(&state.mutex);
+        while (!state.done)
+        {
+            pthread_cond_wait(&state.completed, &state.mutex);
+        }
+        char *serverResponse = state.response;
+        int serverResponseLength = state.responseLength;
+        state.response = NULL;
+        state.done = 0;
+        pthread_mutex_unlock(&state.mutex);
+
+        ConsumeFrame(&connection->input);
+        if (serverResponse == NULL)
+        {
             break;
         }
 
-        if (quit != 1)
+        if (SendAll(connection->socket, serverResponse, serverResponseLength) != 0)
         {
-            if (send(tdL->threadClient, serverResponse, strlen(serverResponse), 0) <= 0)
-            {
-                printf("[SERVER][ERROR][Client %d] Error at recv().\n", tdL->threadID);
-            }
-
-            free(serverResponse);
+            printf("[SERVER][ERROR][Client %d] Error at send().\n", connection->clientId);
+            ReturnBuffer(serverResponse);
+            break;
         }
 
-        memset(clientRequest, 0, strlen(clientRequest));
+        ReturnBuffer(serverResponse);
     }
 
-    close(tdL->threadClient);
+    OnClientDisconnected(connection);
+    FreeConnection(connection);
+
+    pthread_mutex_destroy(&state.mutex);
+    pthread_cond_destroy(&state.completed);
     return (NULL);
 }
 
+void CompleteThreadRequest(Connection *connection, char *response, int responseLength)
+{
+    ThreadRequestState *state = (ThreadRequestState *)connection->owner;
+
+    pthread_mutex_lock(&state->mutex);
+    state->response = response;
+    state->responseLength = responseLength;
+    state->done = 1;
+    pthread_cond_signal(&state->completed);
+    pthread_mutex_unlock(&state->mutex);
+}
+
+// Connection callbacks, shared by the thread per client and the event loop modes
+void OnClientConnected(Connection *connection)
+{
+    LogEvent(connection->clientId, "Client connected");
+}
+
+// Parses the request on the connection's thread and queues its processing on the worker pool.
+// The response is delivered through connection->complete, also when the queue is full.
+int HandleClientRequest(Connection *connection, char *request, int requestLength)
+{
+    struct ServerResponse response = {0};
+    BinaryHeader *header = &connection->requestHeader;
+
+    if (connection->input.mode == FRAME_MODE_BINARY)
+    {
+        // Binary frames always hold a whole header, so it is parsed even when the fields are malformed
+        int parseResult = ParseBinaryRequest(request, requestLength, header, &connection->request);
+        if (header->version != BINARY_PROTOCOL_VERSION)
+        {
+            response.status = 505;
+            response.content = "Unsupported protocol version.";
+        }
+        else if (header->opcode == OPCODE_HELLO)
+        {
+            LogEvent(connection->clientId, "Binary protocol negotiated");
+            response.status = 200;
+        }
+        else if (parseResult != 0)
+        {
+            response.status = 400;
+            response.content = "Bad request.";
+        }
+    }
+    else if (ParseRequestFields(request, requestLength, &connection->request) != 0)
+    {
+        response.status = 400;
+        response.content = "Bad request.";
+    }
+
+    if (response.status != 0)
+    {
+        DeliverResponse(connection, header, response);
+        return 0;
+    }
+
+    LogRequestEvent(connection->clientId, &connection->request);
+
+    if (SubmitJob(WORKERS, &RunRequestJob, connection) != 0)
+    {
+        LogEvent(connection->clientId, "Worker queue full - Request rejected");
+
+        response.status = 503;
+        response.content = "Server busy, try again.";
+        DeliverResponse(connection, header, response);
+    }
+
+    return 0;
+}
+
+void RunRequestJob(void *arg)
+{
+    Connection *connection = (Connection *)arg;
+
+    ServerResponse response = ProcessClientRequest(connection);
+    if (response.status == STATUS_PENDING)
+    {
+        return;
+    }
+
+    DeliverResponse(connection, &connection->requestHeader, response);
+}
+
+// Encodes the response in the protocol the client spoke, in a single pass straight into the buffer that is sent,
+// and hands it to the connection's I/O mode. The response may point into the request arena, which is reset once
+// the response is encoded.
+void DeliverResponse(Connection *connection, const BinaryHeader *header, ServerResponse response)
+{
+    OutputBuffer output;
+    InitOutputBuffer(&output, OUTPUT_BUFFER_SIZE);
+
+    if (connection->input.mode == FRAME_MODE_BINARY)
+    {
+        AppendBinaryResponse(&output, header, &response);
+    }
+    else if (connection->input.mode == FRAME_MODE_LENGTH_PREFIXED)
+    {
+        int frameStart = BeginFrame(&output);
+        AppendServerResponse(&output, &response);
+        EndFrame(&output, frameStart);
+    }
+    else
+    {
+        AppendServerResponse(&output, &response);
+    }
+    ResetArena(&requestArena);
+
+    int responseLength;
+    char *serverResponse = DetachOutputBuffer(&output, &responseLength);
+
+    if (serverResponse == NULL && response.status != 500)
+    {
+        struct ServerResponse internalError = {0};
+        internalError.status = 500;
+        internalError.content = "Server Internal Error!";
+        DeliverResponse(connection, header, internalError);
+        return;
+    }
+
+    // Not even the error could be encoded: the NULL response closes the connection
+    connection->complete(connection, serverResponse, responseLength);
+}
+
+void OnClientDisconnected(Connection *connection)
+{
+    LogEvent(connection->clientId, "Client disconnected");
+}
+
 // Proccesing functions
-char *ProcessClientRequest(const int clientId, ClientRequest requestStructure)
+ServerResponse ProcessClientRequest(Connection *connection)
 {
-    struct ServerResponse responseStructure;
-    int commandNumber = RetrieveCommandNumber(requestStructure.command);
+    const int clientId = connection->clientId;
+    const RequestFields *request = &connection->request;
+    Session *session = &connection->session;
+    struct ServerResponse responseStructure = {0};
+    int commandNumber = request->commandNumber;
     if (commandNumber == -1)
     {
         responseStructure.status = 400;
         responseStructure.content = "Bad request.";
         LogResponseEvent(clientId, responseStructure);
-        return CreateServerResponse(responseStructure.status, responseStructure.content);
+        return responseStructure;
     }
 
-    if (!requestStructure.authorized) // Unauthorized requests handling
+    // Clients without Logout end the session on their side and log in again without the authorized flag
+    if (session->userId != 0 && !request->authorized && (commandNumber == 0 || commandNumber == 1))
+    {
+        session->userId = 0;
+    }
+
+    // The session decides what the connection may do, the authorized flag sent by the client is not trusted
+    if (session->userId == 0) // Unauthorized requests handling
     {
         switch (commandNumber)
         {
         case 0:
-            responseStructure = ProccesLoginRequest(clientId, requestStructure);
+            responseStructure = ProccesLoginRequest(clientId, session, request);
             break;
         case 1:
-            responseStructure = ProccesRegisterRequest(clientId, requestStructure);
+            responseStructure = ProccesRegisterRequest(clientId, session, request);
             break;
         case 2:
-            return CreateServerResponse(200, "Quit");
+            responseStructure.status = 200;
+            responseStructure.content = "Quit";
+            return responseStructure;
+        case 12:
+            responseStructure.status = 200;
+            responseStructure.content = "Logged out";
+            return responseStructure;
         default:
-            return CreateServerResponse(401, "Unauthorized.");
+            responseStructure.status = 401;
+            responseStructure.content = "Unauthorized.";
+            return responseStructure;
         }
     }
     else // Authorized requests handling
@@ -238,28 +577,56 @@ char *ProcessClientRequest(const int clientId, ClientRequest requestStructure)
         switch (commandNumber)
         {
         case 0:
-            return CreateServerResponse(409, "Already logged in.");
         case 1:
-            return CreateServerResponse(409, "Already logged in.");
+            responseStructure.status = 409;
+            responseStructure.content = "Already logged in.";
+            return responseStructure;
         case 2:
-            return CreateServerResponse(200, "Quit");
+            responseStructure.status = 200;
+            responseStructure.content = "Quit";
+            return responseStructure;
         case 3:
-            responseStructure = ProccesViewMessagesRequest(clientId, requestStructure);
+            responseStructure = ProccesViewMessagesRequest(clientId, session, request);
             break;
         case 4:
-            responseStructure = ProcessViewUsersRequest(clientId, requestStructure);
+            responseStructure = ProcessViewUsersRequest(clientId, session, request);
             break;
         case 5:
-            responseStructure = ProcessGetUsersCountRequest(clientId, requestStructure);
+            responseStructure = ProcessGetUsersCountRequest(clientId, session, request);
             break;
         case 6:
-            responseStructure = ProcessGetMessagesCountRequest(clientId, requestStructure);
+            responseStructure = ProcessGetMessagesCountRequest(clientId, session, request);
             break;
         case 7:
-            responseStructure = ProcessInsertMessageRequest(clientId, requestStructure);
+            responseStructure = ProcessInsertMessageRequest(connection);
+            if (responseStructure.status == STATUS_PENDING)
+            {
+                return responseStructure;
+            }
             break;
         case 8:
-            responseStructure = ProccesUpdateMessageReadRequest(clientId, requestStructure);
+            responseStructure = ProccesUpdateMessageReadRequest(clientId, session, request);
+            break;
+        case 9:
+            responseStructure = ProccesViewMessagesRequest(clientId, session, request);
+            break;
+        case 10:
+            responseStructure = ProcessViewUsersRequest(clientId, session, request);
+            break;
+        case 11:
+            responseStructure = ProcessMarkConversationReadRequest(clientId, session, request);
+            break;
+        case 12:
+            session->userId = 0;
+            responseStructure.status = 200;
+            responseStructure.content = "Logged out";
+            LogEvent(clientId, "Logout - Session - Ended");
+            break;
+        case 13:
+            responseStructure = ProcessGetCacheStatsRequest(clientId, session, request);
+            break;
+        case 14:
+            responseStructure = ProcessSyncMessagesRequest(clientId, session, request);
             break;
         default:
             break;
@@ -267,229 +634,252 @@ char *ProcessClientRequest(const int clientId, ClientRequest requestStructure)
     }
 
     LogResponseEvent(clientId, responseStructure);
-    return CreateServerResponse(responseStructure.status, responseStructure.content);
+    return responseStructure;
 }
 
-ServerResponse ProccesLoginRequest(const int clientId, ClientRequest clientRequest)
+ServerResponse ProccesLoginRequest(const int clientId, Session *session, const RequestFields *request)
 {
-    struct ServerResponse serverResponseStructure;
-
-    int numberOfInputs = 0;
-    char **userInputs = ParseContent(clientRequest.content, &numberOfInputs);
+    struct ServerResponse serverResponseStructure = {0};
 
-    if (userInputs == NULL || numberOfInputs != 2)
+    if (request->fieldsCount != 2)
     {
         serverResponseStructure.status = 500;
         serverResponseStructure.content = "Server Internal Error!";
 
-        FreeParsedStrings(userInputs, numberOfInputs);
         LogEvent(clientId, "Login - Unsuccesfully Parse Content");
         return serverResponseStructure;
     }
     LogEvent(clientId, "Login - Succesfully Parse Content");
 
-    int usersCountByUsernameAndPassword = GetUsersCountByUsernameAndPassword(DB, userInputs[0], userInputs[1]);
-    switch (usersCountByUsernameAndPassword)
+    const char *username = request->fields[0].data;
+    int userId = AuthenticateUser(USERS, username, request->fields[1].data);
+    if (userId == -1)
     {
-    case 0:
         serverResponseStructure.status = 401;
         serverResponseStructure.content = "Check Username and Password.";
-        LogEvent(clientId, "Login - Database - GetUsersCountByUsernameAndPassword - Count = 0");
-        break;
-    case 1:
+        LogEvent(clientId, "Login - Users - AuthenticateUser - No Match");
+    }
+    else
+    {
+        session->userId = userId;
         serverResponseStructure.status = 200;
-        serverResponseStructure.content = strdup(userInputs[0]);
-        LogEvent(clientId, "Login - Database - GetUsersCountByUsernameAndPassword - Count = 1");
-        break;
-    default:
-        serverResponseStructure.status = 500;
-        serverResponseStructure.content = "Internal Server Error!";
-        LogEvent(clientId, "Login - Database - GetUsersCountByUsernameAndPassword - Count = -1");
-        break;
+        serverResponseStructure.content = ArenaStrdup(&requestArena, username);
+        LogEvent(clientId, "Login - Users - AuthenticateUser - Match");
     }
 
-    FreeParsedStrings(userInputs, numberOfInputs);
     return serverResponseStructure;
 }
 
-ServerResponse ProccesRegisterRequest(const int clientId, ClientRequest clientRequest)
+ServerResponse ProccesRegisterRequest(const int clientId, Session *session, const RequestFields *request)
 {
-    struct ServerResponse serverResponseStructure;
-
-    int numberOfInputs = 0;
-    char **userInputs = ParseContent(clientRequest.content, &numberOfInputs);
+    struct ServerResponse serverResponseStructure = {0};
 
-    if (userInputs == NULL || numberOfInputs != 5)
+    if (request->fieldsCount != 5)
     {
         serverResponseStructure.status = 500;
         serverResponseStructure.content = "Server Internal Error!";
 
-        FreeParsedStrings(userInputs, numberOfInputs);
         LogEvent(clientId, "Register - Unsuccesfully Parse Content");
         return serverResponseStructure;
     }
     LogEvent(clientId, "Register - Succesfully Parse Content");
 
-    int usersCountByUsername = GetUsersCountByUsername(DB, userInputs[0]);
-    if (usersCountByUsername > 0)
+    // Usernames are sent to text clients inside list rows, whatever protocol registered them
+    const char *username = request->fields[0].data;
+    if (strpbrk(username, ":#|") != NULL)
     {
-        serverResponseStructure.status = 409;
-        serverResponseStructure.content = "Username already exists!";
+        serverResponseStructure.status = 400;
+        serverResponseStructure.content = "Username can't contain \":\", \"|\" or \"#\"!";
 
-        FreeParsedStrings(userInputs, numberOfInputs);
-        LogEvent(clientId, "Register - Database - GetUsersCountByUsername - Count Bigger > 0");
+        LogEvent(clientId, "Register - Validate Username - Delimiter");
         return serverResponseStructure;
     }
-    if (usersCountByUsername <= -1)
+
+    if (FindUserId(USERS, username) != -1)
     {
-        serverResponseStructure.status = 500;
-        serverResponseStructure.content = "Server Internal Error!";
+        serverResponseStructure.status = 409;
+        serverResponseStructure.content = "Username already exists!";
 
-        FreeParsedStrings(userInputs, numberOfInputs);
-        LogEvent(clientId, "Register - Database - GetUsersCountByUsername - Count Lower < 0");
+        LogEvent(clientId, "Register - Users - FindUserId - Found");
         return serverResponseStructure;
     }
 
-    int insertResult = InsertUser(DB, userInputs[0], userInputs[1], userInputs[2], userInputs[3]);
+    int userId = InsertUser(DB->writer, username, request->fields[1].data, request->fields[2].data, request->fields[3].data);
 
-    if (insertResult != 0)
+    // A concurrent registration of the same username can pass the directory check first
+    if (userId == USER_EXISTS)
+    {
+        serverResponseStructure.status = 409;
+        serverResponseStructure.content = "Username already exists!";
+        LogEvent(clientId, "Register - Database - Insert - Username Exists");
+    }
+    else if (userId <= 0)
     {
         serverResponseStructure.status = 500;
         serverResponseStructure.content = "Internal Server Error!";
         LogEvent(clientId, "Register - Database - Insert - Unsuccesful");
     }
+    else if (AddUser(USERS, userId, username, request->fields[3].data) != 0)
+    {
+        // The user is committed, but can't log in until the directory is loaded again on the next server start
+        InvalidateUsersPages(PAGES);
+        printf("[SERVER][ERROR] User %s registered but not added to the users directory!\n", username);
+        fflush(stdout);
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Registered, but the server must reload its users before you can log in!";
+        LogEvent(clientId, "Register - Users - AddUser - Unsuccesful");
+    }
     else
     {
+        InvalidateUsersPages(PAGES);
+        session->userId = userId;
         serverResponseStructure.status = 201;
-        serverResponseStructure.content = strdup(userInputs[0]);
+        serverResponseStructure.content = ArenaStrdup(&requestArena, username);
         LogEvent(clientId, "Register - Database - Insert - Succesful");
     }
 
-    FreeParsedStrings(userInputs, numberOfInputs);
     return serverResponseStructure;
 }
 
-ServerResponse ProcessViewUsersRequest(const int clientId, ClientRequest clientRequest)
+ServerResponse ProcessViewUsersRequest(const int clientId, const Session *session, const RequestFields *request)
 {
-    struct ServerResponse serverResponseStructure;
+    struct ServerResponse serverResponseStructure = {0};
 
-    int numberOfFields = 0;
-    char **fields = ParseContent(clientRequest.content, &numberOfFields);
-    if (numberOfFields != 2)
+    int first = SessionFieldsOffset(session, request, 1);
+    if (first == -1)
     {
         serverResponseStructure.status = 500;
         serverResponseStructure.content = "Server Internal Error";
-        LogEvent(clientId, "View_Users - ParseContent - Count != 2");
+        LogEvent(clientId, "View_Users - ParseContent - Count != 1");
 
         return serverResponseStructure;
     }
 
-    int userExists = GetUsersCountByUsername(DB, fields[0]);
-    if (userExists != 1)
-    {
-        serverResponseStructure.status = 400;
-        serverResponseStructure.content = "Username doesn't exists!";
-        LogEvent(clientId, "View_Users - Database - GetUsersCountByUsername - Count != 1");
-
-        return serverResponseStructure;
-    }
+    int currentUserId = session->userId;
 
-    int usersCount = GetUsersCount(DB);
-    if (usersCount == 1)
+    if (GetDirectoryUsersCount(USERS) == 1)
     {
         serverResponseStructure.status = 200;
         serverResponseStructure.content = "";
-        LogEvent(clientId, "View_Users - Database - GetUsersCount - Count == 1");
+        LogEvent(clientId, "View_Users - Users - GetDirectoryUsersCount - Count == 1");
 
         return serverResponseStructure;
     }
-    else if (usersCount <= 0)
-    {
-        serverResponseStructure.status = 500;
-        serverResponseStructure.content = "Server Internal Error";
-        LogEvent(clientId, "View_Users - Database - GetUsersCount - Unsuccesful");
 
-        return serverResponseStructure;
+    PageKey pageKey = {request->commandNumber, currentUserId, 0, 0, NULL};
+    if (request->commandNumber == COMMAND_VIEW_USERS_AFTER)
+    {
+        pageKey.cursor = request->fields[first].data;
     }
-
-    char **usernames = (char **)malloc(10 * sizeof(char *));
-
-    int usernamesCount = GetUsernamesWhereNotEqualUsername(DB, usernames, fields[0], atoi(fields[1]));
-    if (usernamesCount <= -1)
+    else
     {
-        serverResponseStructure.status = 500;
-        serverResponseStructure.content = "Internal Server Error!";
-        LogEvent(clientId, "View_Users - Database - GetUsernames - Unsuccesful");
-
-        return serverResponseStructure;
+        pageKey.argument = GetIntField(request, first);
     }
-    LogEvent(clientId, "View_Users - Database - GetUsernames - Succesful");
 
-    int unreadMessagesCounts[usernamesCount];
-    for (int i = 0; i < usernamesCount; i++)
+    unsigned long long pageVersion;
+    if (LookupPage(PAGES, &pageKey, &requestArena, &serverResponseStructure, &pageVersion))
     {
-        int count = GetUnreadMessagesCountBetweenUsers(DB, fields[0], usernames[i]);
-        if (count < 0)
-        {
-            serverResponseStructure.status = 500;
-            serverResponseStructure.content = "Internal Server Error!";
-            LogEvent(clientId, "View_Users - Database - GetUnreadMessagesCount - Unsuccesful");
-
-            return serverResponseStructure;
-        }
+        serverResponseStructure.status = 200;
+        LogEvent(clientId, "View_Users - Cache - Hit");
 
-        unreadMessagesCounts[i] = count;
+        return serverResponseStructure;
     }
 
-    char *content = PrepareUsersViewContent(usernames, &unreadMessagesCounts, usernamesCount);
-    if (content == NULL)
+    UserViewStructure *users = (UserViewStructure *)ArenaAlloc(&requestArena, 10 * sizeof(UserViewStructure));
+    if (users == NULL)
     {
         serverResponseStructure.status = 500;
         serverResponseStructure.content = "Server Internal Error!";
         LogEvent(clientId, "View_Users - PrepareContent - Allocation Error");
+
+        return serverResponseStructure;
+    }
+
+    // View_Users_After pages by the last username seen, View_Users by page number; both read the unread counts in the same query
+    int usersPageCount;
+    if (request->commandNumber == COMMAND_VIEW_USERS_AFTER)
+    {
+        usersPageCount = GetUsersAfterUsername(ReaderConnection(DB), &requestArena, users, currentUserId, pageKey.cursor);
     }
     else
     {
-        serverResponseStructure.status = 200;
-        serverResponseStructure.content = strdup(content);
-        LogEvent(clientId, "View_Users - PrepareContent - Succesful");
+        usersPageCount = GetUsersWhereNotEqualUser(ReaderConnection(DB), &requestArena, users, currentUserId, pageKey.argument);
+    }
+    if (usersPageCount <= -1)
+    {
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Internal Server Error!";
+        LogEvent(clientId, "View_Users - Database - GetUsers - Unsuccesful");
+
+        return serverResponseStructure;
     }
+    LogEvent(clientId, "View_Users - Database - GetUsers - Succesful");
 
-    free(content);
-    FreeParsedStrings(usernames, usernamesCount);
-    FreeParsedStrings(fields, numberOfFields);
+    serverResponseStructure.users = users;
+    serverResponseStructure.rowsCount = usersPageCount;
+    StorePage(PAGES, &pageKey, pageVersion, &serverResponseStructure);
+
+    serverResponseStructure.status = 200;
+    LogEvent(clientId, "View_Users - PrepareContent - Succesful");
 
     return serverResponseStructure;
 }
 
-ServerResponse ProccesViewMessagesRequest(const int clientId, ClientRequest clientRequest)
+ServerResponse ProccesViewMessagesRequest(const int clientId, const Session *session, const RequestFields *request)
 {
-    struct ServerResponse serverResponseStructure;
+    struct ServerResponse serverResponseStructure = {0};
 
-    int numberOfFields = 0;
-    char **fields = ParseContent(clientRequest.content, &numberOfFields);
-    if (numberOfFields != 3)
+    int first = SessionFieldsOffset(session, request, 2);
+    if (first == -1)
     {
         serverResponseStructure.status = 500;
         serverResponseStructure.content = "Server Internal Error";
-        LogEvent(clientId, "View_Messages - ParseContent - Count != 3");
+        LogEvent(clientId, "View_Messages - ParseContent - Count != 2");
 
         return serverResponseStructure;
     }
 
-    int userExists = GetUsersCountByUsername(DB, fields[1]);
-    if (userExists != 1)
+    int loggedUserId = session->userId;
+    int selectedUserId = FindUserId(USERS, request->fields[first].data);
+    if (selectedUserId == -1)
     {
         serverResponseStructure.status = 400;
         serverResponseStructure.content = "Username doesn't exists!";
-        LogEvent(clientId, "View_Messages - Database - GetUsersCountByUsername - Count != 1");
+        LogEvent(clientId, "View_Messages - Users - FindUserId - Not Found");
 
         return serverResponseStructure;
     }
 
-    char **messages = (char **)malloc(10 * sizeof(char *));
+    PageKey pageKey = {request->commandNumber, loggedUserId, selectedUserId, GetIntField(request, first + 1), NULL};
+    unsigned long long pageVersion;
+    if (LookupPage(PAGES, &pageKey, &requestArena, &serverResponseStructure, &pageVersion))
+    {
+        serverResponseStructure.status = 200;
+        LogEvent(clientId, "View_Messages - Cache - Hit");
 
-    int messagesCount = GetMessagesBetweenUsers(DB, messages, fields[0], fields[1], atoi(fields[2]));
+        return serverResponseStructure;
+    }
+
+    MessageStructure *messages = (MessageStructure *)ArenaAlloc(&requestArena, 10 * sizeof(MessageStructure));
+    if (messages == NULL)
+    {
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Server Internal Error!";
+        LogEvent(clientId, "View_Messages - PrepareContent - Allocation Error");
+
+        return serverResponseStructure;
+    }
+
+    // View_Messages_Before pages by the oldest message id seen, View_Messages by page number
+    int messagesCount;
+    if (request->commandNumber == COMMAND_VIEW_MESSAGES_BEFORE)
+    {
+        messagesCount = GetMessagesBetweenUsersBefore(ReaderConnection(DB), &requestArena, messages, loggedUserId, selectedUserId, pageKey.argument);
+    }
+    else
+    {
+        messagesCount = GetMessagesBetweenUsers(ReaderConnection(DB), &requestArena, messages, loggedUserId, selectedUserId, pageKey.argument);
+    }
     if (messagesCount <= -1)
     {
         serverResponseStructure.status = 500;
@@ -500,55 +890,50 @@ ServerResponse ProccesViewMessagesRequest(const int clientId, ClientRequest clie
     }
     LogEvent(clientId, "View_Messages - Database - GetMessagesBetweenUsers - Succesful");
 
-    char *content = PrepareViewContent(messages, messagesCount);
-    if (content == NULL)
+    if (NameMessageSenders(messages, messagesCount) != 0)
     {
         serverResponseStructure.status = 500;
-        serverResponseStructure.content = "Server Internal Error!";
-        LogEvent(clientId, "View_Messages - PrepareContent - Allocation Error");
-    }
-    else
-    {
-        serverResponseStructure.status = 200;
-        serverResponseStructure.content = strdup(content);
-        LogEvent(clientId, "View_Messages - PrepareContent - Succesful");
+        serverResponseStructure.content = "Internal Server Error!";
+        LogEvent(clientId, "View_Messages - Users - FindUsername - Unsuccesful");
+
+        return serverResponseStructure;
     }
 
-    free(content);
-    FreeParsedStrings(messages, messagesCount);
-    FreeParsedStrings(fields, numberOfFields);
+    serverResponseStructure.messages = messages;
+    serverResponseStructure.rowsCount = messagesCount;
+    StorePage(PAGES, &pageKey, pageVersion, &serverResponseStructure);
+
+    serverResponseStructure.status = 200;
+    LogEvent(clientId, "View_Messages - PrepareContent - Succesful");
 
     return serverResponseStructure;
 }
 
-ServerResponse ProcessGetUsersCountRequest(const int clientId, ClientRequest clientRequest)
+ServerResponse ProcessGetUsersCountRequest(const int clientId, const Session *session, const RequestFields *request)
 {
-    struct ServerResponse serverResponseStructure;
-
-    char *currentUser = strdup(clientRequest.content);
+    struct ServerResponse serverResponseStructure = {0};
 
-    int userExists = GetUsersCountByUsername(DB, currentUser);
-    if (userExists != 1)
+    if (SessionFieldsOffset(session, request, 0) == -1)
     {
-        serverResponseStructure.status = 400;
-        serverResponseStructure.content = "Username doesn't exists!";
-        LogEvent(clientId, "Get_Users_Count - Database - GetUsersCountByUsername - Count != 1");
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Server Internal Error";
+        LogEvent(clientId, "Get_Users_Count - ParseContent - Count != 0");
 
         return serverResponseStructure;
     }
 
-    int usersCount = GetUsersCount(DB);
+    int usersCount = GetDirectoryUsersCount(USERS);
     if (usersCount <= 0)
     {
-        LogEvent(clientId, "Get_Users_Count - Database - GetUsersCount - Unsuccesful");
+        LogEvent(clientId, "Get_Users_Count - Users - GetDirectoryUsersCount - Unsuccesful");
         serverResponseStructure.status = 500;
         serverResponseStructure.content = "Server Internal Error";
     }
     else
     {
-        LogEvent(clientId, "Get_Users_Count - Database - GetUsersCount - Succesful");
-        int len = snprintf(NULL, 0, "%d", usersCount);
-        if (len <= 0)
+        LogEvent(clientId, "Get_Users_Count - Users - GetDirectoryUsersCount - Succesful");
+        serverResponseStructure.content = ArenaPrintf(&requestArena, "%d", usersCount);
+        if (serverResponseStructure.content == NULL)
         {
             LogEvent(clientId, "Get_Users_Count - Create Response Error");
             serverResponseStructure.status = 500;
@@ -557,44 +942,38 @@ ServerResponse ProcessGetUsersCountRequest(const int clientId, ClientRequest cli
             return serverResponseStructure;
         }
 
-        char *content = (char *)malloc(len + 1);
-        snprintf(content, len + 1, "%d", usersCount);
-
         serverResponseStructure.status = 200;
-        serverResponseStructure.content = strdup(content);
-
-        free(content);
     }
 
     return serverResponseStructure;
 }
 
-ServerResponse ProcessGetMessagesCountRequest(const int clientId, ClientRequest clientRequest)
+ServerResponse ProcessGetMessagesCountRequest(const int clientId, const Session *session, const RequestFields *request)
 {
-    struct ServerResponse serverResponseStructure;
+    struct ServerResponse serverResponseStructure = {0};
 
-    int numberOfFields = 0;
-    char **fields = ParseContent(clientRequest.content, &numberOfFields);
-    if (numberOfFields != 2)
+    int first = SessionFieldsOffset(session, request, 1);
+    if (first == -1)
     {
         serverResponseStructure.status = 500;
         serverResponseStructure.content = "Server Internal Error";
-        LogEvent(clientId, "Get_Messages_Count - ParseContent - Count != 2");
+        LogEvent(clientId, "Get_Messages_Count - ParseContent - Count != 1");
 
         return serverResponseStructure;
     }
 
-    int userExists = GetUsersCountByUsername(DB, fields[1]);
-    if (userExists != 1)
+    int loggedUserId = session->userId;
+    int selectedUserId = FindUserId(USERS, request->fields[first].data);
+    if (selectedUserId == -1)
     {
         serverResponseStructure.status = 400;
         serverResponseStructure.content = "Username doesn't exists!";
-        LogEvent(clientId, "Get_Messages_Count - Database - GetUsersCountByUsername - Count != 1");
+        LogEvent(clientId, "Get_Messages_Count - Users - FindUserId - Not Found");
 
         return serverResponseStructure;
     }
 
-    int messagesCount = GetMessagesCountBetweenUsers(DB, fields[0], fields[1]);
+    int messagesCount = GetMessagesCountBetweenUsers(ReaderConnection(DB), loggedUserId, selectedUserId);
     if (messagesCount < 0)
     {
         LogEvent(clientId, "Get_Messages_Count - Database - GetMessagesCountBetweenUsers - Unsuccesful");
@@ -604,8 +983,8 @@ ServerResponse ProcessGetMessagesCountRequest(const int clientId, ClientRequest
     else
     {
         LogEvent(clientId, "Get_Messages_Count - Database - GetMessagesCountBetweenUsers - Succesful");
-        int len = snprintf(NULL, 0, "%d", messagesCount);
-        if (len <= 0)
+        serverResponseStructure.content = ArenaPrintf(&requestArena, "%d", messagesCount);
+        if (serverResponseStructure.content == NULL)
         {
             LogEvent(clientId, "Get_Messages_Count - Create Response Error");
             serverResponseStructure.status = 500;
@@ -614,26 +993,20 @@ ServerResponse ProcessGetMessagesCountRequest(const int clientId, ClientRequest
             return serverResponseStructure;
         }
 
-        char *content = (char *)malloc(len + 1);
-        snprintf(content, len + 1, "%d", messagesCount);
-
         serverResponseStructure.status = 200;
-        serverResponseStructure.content = strdup(content);
-
-        free(content);
     }
 
-    FreeParsedStrings(fields, numberOfFields);
     return serverResponseStructure;
 }
 
-ServerResponse ProcessInsertMessageRequest(const int clientId, ClientRequest clientRequest)
+ServerResponse ProcessInsertMessageRequest(Connection *connection)
 {
-    struct ServerResponse serverResponseStructure;
+    const int clientId = connection->clientId;
+    const RequestFields *request = &connection->request;
+    struct ServerResponse serverResponseStructure = {0};
 
-    int numberOfFields = 0;
-    char **fields = ParseContent(clientRequest.content, &numberOfFields);
-    if (numberOfFields != 4)
+    int first = SessionFieldsOffset(&connection->session, request, 3);
+    if (first == -1)
     {
         serverResponseStructure.status = 500;
         serverResponseStructure.content = "Server Internal Error";
@@ -642,152 +1015,362 @@ ServerResponse ProcessInsertMessageRequest(const int clientId, ClientRequest cli
         return serverResponseStructure;
     }
 
-    int userExists = GetUsersCountByUsername(DB, fields[1]);
-    if (userExists != 1)
+    int senderId = connection->session.userId;
+    int receiverId = FindUserId(USERS, request->fields[first].data);
+    if (receiverId == -1)
     {
         serverResponseStructure.status = 400;
         serverResponseStructure.content = "Username doesn't exists!";
-        LogEvent(clientId, "Insert_Message - Database - GetUsersCountByUsername - Count != 1");
+        LogEvent(clientId, "Insert_Message - Users - FindUserId - Not Found");
 
         return serverResponseStructure;
     }
 
-    int insertResult = InsertMessage(DB, fields[0], fields[1], fields[2], atoi(fields[3]));
-    if (insertResult != 0)
+    // The message points into the connection buffer, which is kept until the response is delivered
+    int queueResult = QueueMessageInsert(WRITES, senderId, receiverId, request->fields[first + 1].data, GetIntField(request, first + 2),
+                                         &CompleteInsertMessage, connection);
+    if (queueResult != 0)
+    {
+        serverResponseStructure.status = 503;
+        serverResponseStructure.content = "Server busy, try again.";
+        LogEvent(clientId, "Insert_Message - Write queue full - Request rejected");
+
+        return serverResponseStructure;
+    }
+
+    serverResponseStructure.status = STATUS_PENDING;
+    return serverResponseStructure;
+}
+
+// Runs on the writer thread once the message batch is committed.
+void CompleteInsertMessage(void *context, const QueuedMessage *message)
+{
+    Connection *connection = (Connection *)context;
+    struct ServerResponse serverResponseStructure = {0};
+
+    if (message->result != 0)
     {
         serverResponseStructure.status = 500;
         serverResponseStructure.content = "Internal Server Error!";
-        LogEvent(clientId, "Insert_Message - Database - Insert - Unsuccesful");
+        LogEvent(connection->clientId, "Insert_Message - Database - Insert - Unsuccesful");
     }
     else
     {
+        // The conversation has a new message and the receiver a new unread one
+        InvalidateConversationPages(PAGES, message->senderId, message->receiverId);
+        InvalidateUserPages(PAGES, message->receiverId);
         serverResponseStructure.status = 201;
         serverResponseStructure.content = "Created";
-        LogEvent(clientId, "Insert_Message - Database - Insert - Succesful");
+        LogEvent(connection->clientId, "Insert_Message - Database - Insert - Succesful");
     }
 
-    FreeParsedStrings(fields, numberOfFields);
-    return serverResponseStructure;
+    LogResponseEvent(connection->clientId, serverResponseStructure);
+    DeliverResponse(connection, &connection->requestHeader, serverResponseStructure);
 }
 
-ServerResponse ProccesUpdateMessageReadRequest(const int clientId, ClientRequest clientRequest)
+ServerResponse ProccesUpdateMessageReadRequest(const int clientId, const Session *session, const RequestFields *request)
 {
-    struct ServerResponse serverResponseStructure;
+    struct ServerResponse serverResponseStructure = {0};
 
-    int numberOfFields = 0;
-    char **fields = ParseContent(clientRequest.content, &numberOfFields);
+    int messageIds[MAX_REQUEST_FIELDS];
+    for (int i = 0; i < request->fieldsCount; i++)
+    {
+        messageIds[i] = GetIntField(request, i);
+    }
 
-    for (int i = 0; i < numberOfFields; i++)
+    int changed = UpdateMessagesRead(DB->writer, session->userId, messageIds, request->fieldsCount);
+    if (changed < 0)
     {
-        int updateResult = UpdateMessage(DB, atoi(fields[i]));
-        if (updateResult != 0)
-        {
-            LogEvent(clientId, "Update_Message_Read - Database - Update - Unsuccesful");
-        }
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Internal Server Error!";
+        LogEvent(clientId, "Update_Message_Read - Database - Update - Unsuccesful");
+
+        return serverResponseStructure;
     }
 
-    LogEvent(clientId, "Update_Message_Read - Database - Update - Finished");
+    // The conversations of the messages aren't known here; this path is only kept for older clients
+    if (changed > 0)
+    {
+        InvalidatePages(PAGES);
+    }
 
     serverResponseStructure.status = 200;
-    serverResponseStructure.content = "Updated";
+    serverResponseStructure.content = ArenaPrintf(&requestArena, "%d", changed);
     LogEvent(clientId, "Update_Message_Read - Update - Succesful");
 
     return serverResponseStructure;
 }
 
-char *PrepareUsersViewContent(const char **rows, const int *counts, int rowsCount)
+ServerResponse ProcessMarkConversationReadRequest(const int clientId, const Session *session, const RequestFields *request)
 {
-    char **rowsWithCounts = (char **)malloc(rowsCount * sizeof(char *));
-    for (int i = 0; i < rowsCount; i++)
+    struct ServerResponse serverResponseStructure = {0};
+
+    int first = SessionFieldsOffset(session, request, 2);
+    if (first == -1)
     {
-        int len = snprintf(NULL, 0, "%s|%d|", rows[i], counts[i]);
-        if (len < 0)
-        {
-            return NULL;
-        }
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Server Internal Error";
+        LogEvent(clientId, "Mark_Conversation_Read - ParseContent - Count != 2");
+
+        return serverResponseStructure;
+    }
+
+    int readerId = session->userId;
+    int peerId = FindUserId(USERS, request->fields[first].data);
+    if (peerId == -1)
+    {
+        serverResponseStructure.status = 400;
+        serverResponseStructure.content = "Username doesn't exists!";
+        LogEvent(clientId, "Mark_Conversation_Read - Users - FindUserId - Not Found");
+
+        return serverResponseStructure;
+    }
+
+    int changed = MarkConversationRead(DB->writer, readerId, peerId, GetIntField(request, first + 1));
+    if (changed < 0)
+    {
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Internal Server Error!";
+        LogEvent(clientId, "Mark_Conversation_Read - Database - Update - Unsuccesful");
+
+        return serverResponseStructure;
+    }
 
-        rowsWithCounts[i] = (char **)malloc(len + 1);
-        snprintf(rowsWithCounts[i], len + 1, "%s|%d|", rows[i], counts[i]);
+    if (changed > 0)
+    {
+        InvalidateConversationPages(PAGES, readerId, peerId);
+        InvalidateUserPages(PAGES, readerId);
     }
 
-    char *content = PrepareViewContent(rowsWithCounts, rowsCount);
+    serverResponseStructure.status = 200;
+    serverResponseStructure.content = changed > 0 ? "Updated" : "Already read";
+    LogEvent(clientId, "Mark_Conversation_Read - Update - Succesful");
 
-    free(rowsWithCounts);
-    return content;
+    return serverResponseStructure;
 }
 
-char *PrepareViewContent(const char **rows, int rowsCount)
+ServerResponse ProcessGetCacheStatsRequest(const int clientId, const Session *session, const RequestFields *request)
 {
-    int contentLength = 0;
-    for (int i = 0; i < rowsCount; i++)
+    struct ServerResponse serverResponseStructure = {0};
+
+    if (SessionFieldsOffset(session, request, 0) == -1)
     {
-        int rowLength = snprintf(NULL, 0, "%s#", rows[i]);
-        if (rowLength <= 0)
-        {
-            return NULL;
-        }
-        contentLength += rowLength;
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Server Internal Error";
+        LogEvent(clientId, "Get_Cache_Stats - ParseContent - Count != 0");
+
+        return serverResponseStructure;
     }
 
-    char *content = (char *)malloc(contentLength + 1);
-    if (content == NULL)
+    unsigned long long hits, misses;
+    GetPageCacheStats(PAGES, &hits, &misses);
+
+    // "hits#misses#", like the fields of a request
+    serverResponseStructure.content = ArenaPrintf(&requestArena, "%llu#%llu#", hits, misses);
+    if (serverResponseStructure.content == NULL)
     {
-        return NULL;
+        LogEvent(clientId, "Get_Cache_Stats - Create Response Error");
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Server Internal Error";
+
+        return serverResponseStructure;
     }
 
-    int offset = 0;
-    for (int i = 0; i < rowsCount; i++)
+    serverResponseStructure.status = 200;
+    LogEvent(clientId, "Get_Cache_Stats - Succesful");
+
+    return serverResponseStructure;
+}
+
+// Helper functions
+int ParseServerConfig(int argc, char *argv[], ServerConfig *config)
+{
+    config->mode = MODE_THREADS;
+    config->loopsCount = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    config->workersCount = config->loopsCount;
+    config->queueCapacity = 1024;
+    config->shardListeners = 0;
+    config->backlog = SOMAXCONN;
+
+    int option;
+    while ((option = getopt(argc, argv, "m:l:w:q:sb:")) != -1)
     {
-        offset += snprintf((content + offset), contentLength - offset + 1, "%s#", rows[i]);
-        if (offset <= 0)
+        switch (option)
         {
-            return NULL;
+        case 'm':
+            if (strcmp(optarg, "threads") == 0)
+            {
+                config->mode = MODE_THREADS;
+            }
+            else if (strcmp(optarg, "epoll") == 0)
+            {
+                config->mode = MODE_EPOLL;
+            }
+            else if (strcmp(optarg, "uring") == 0)
+            {
+                config->mode = MODE_IO_URING;
+            }
+            else
+            {
+                return -1;
+            }
+            break;
+        case 'l':
+            config->loopsCount = atoi(optarg);
+            if (config->loopsCount <= 0)
+            {
+                return -1;
+            }
+            break;
+        case 'w':
+            config->workersCount = atoi(optarg);
+            if (config->workersCount <= 0)
+            {
+                return -1;
+            }
+            break;
+        case 'q':
+            config->queueCapacity = atoi(optarg);
+            if (config->queueCapacity <= 0)
+            {
+                return -1;
+            }
+            break;
+        case 's':
+            config->shardListeners = 1;
+            break;
+        case 'b':
+            config->backlog = atoi(optarg);
+            if (config->backlog <= 0)
+            {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
         }
     }
 
-    return content;
+    return 0;
 }
 
-// Helper functions
-int FileExists(const char *filename)
+void RaiseOpenFilesLimit()
 {
-    return access(filename, F_OK) != -1;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 }
 
-int CreateFile()
+// The index of the first field after the session user. Clients predating sessions still send their username
+// as the first field, it is skipped once checked against the session. -1 when the fields don't match.
+int SessionFieldsOffset(const Session *session, const RequestFields *request, int fieldsCount)
 {
-    time_t currentTime;
-    struct tm timeInfo;
+    if (request->fieldsCount == fieldsCount)
+    {
+        return 0;
+    }
 
-    char timeString[50];
-    memset(timeString, 0, 50);
+    if (request->fieldsCount == fieldsCount + 1 && FindUserId(USERS, request->fields[0].data) == session->userId)
+    {
+        return 1;
+    }
 
-    time(&currentTime);
+    return -1;
+}
 
-    localtime_r(&currentTime, &timeInfo);
+// Answers with the messages newer than the last one the client holds and the state to update the ones it already has.
+// Not cached: the answer depends on the client's last message id and is small when nothing changed.
+ServerResponse ProcessSyncMessagesRequest(const int clientId, const Session *session, const RequestFields *request)
+{
+    struct ServerResponse serverResponseStructure = {0};
 
-    strftime(timeString, 50, "%Y-%m-%d_%H:%M:%S", &timeInfo);
+    int first = SessionFieldsOffset(session, request, 2);
+    if (first == -1)
+    {
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Server Internal Error";
+        LogEvent(clientId, "Sync_Messages - ParseContent - Count != 2");
 
-    int len = snprintf(NULL, 0, "%s%s_LOGS.txt", FILENAME_FOLDER, timeString);
-    if (len <= 0)
+        return serverResponseStructure;
+    }
+
+    int loggedUserId = session->userId;
+    int selectedUserId = FindUserId(USERS, request->fields[first].data);
+    if (selectedUserId == -1)
     {
-        return 0;
+        serverResponseStructure.status = 400;
+        serverResponseStructure.content = "Username doesn't exists!";
+        LogEvent(clientId, "Sync_Messages - Users - FindUserId - Not Found");
+
+        return serverResponseStructure;
     }
 
-    FILE_NAME = (char *)malloc(len + 1);
-    snprintf(FILE_NAME, len + 1, "%s%s_LOGS.txt", FILENAME_FOLDER, timeString);
+    MessageStructure *messages = (MessageStructure *)ArenaAlloc(&requestArena, 10 * sizeof(MessageStructure));
+    SyncState *state = (SyncState *)ArenaAlloc(&requestArena, sizeof(SyncState));
+    if (messages == NULL || state == NULL)
+    {
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Server Internal Error!";
+        LogEvent(clientId, "Sync_Messages - PrepareContent - Allocation Error");
 
-    FILE *file = fopen(FILE_NAME, "a");
-    if (file == NULL)
+        return serverResponseStructure;
+    }
+
+    int messagesCount = SyncConversation(ReaderConnection(DB), &requestArena, messages, state, loggedUserId, selectedUserId, GetIntField(request, first + 1));
+    if (messagesCount <= -1)
     {
-        return 0;
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Internal Server Error!";
+        LogEvent(clientId, "Sync_Messages - Database - SyncConversation - Unsuccesful");
+
+        return serverResponseStructure;
+    }
+    LogEvent(clientId, "Sync_Messages - Database - SyncConversation - Succesful");
+
+    if (NameMessageSenders(messages, messagesCount) != 0)
+    {
+        serverResponseStructure.status = 500;
+        serverResponseStructure.content = "Internal Server Error!";
+        LogEvent(clientId, "Sync_Messages - Users - FindUsername - Unsuccesful");
+
+        return serverResponseStructure;
+    }
+
+    serverResponseStructure.messages = messages;
+    serverResponseStructure.rowsCount = messagesCount;
+    serverResponseStructure.sync = state;
+
+    serverResponseStructure.status = 200;
+    LogEvent(clientId, "Sync_Messages - PrepareContent - Succesful");
+
+    return serverResponseStructure;
+}
+
+// Copies the interned usernames of the senders into the rows, -1 when one can't be named.
+int NameMessageSenders(MessageStructure *messages, int messagesCount)
+{
+    for (int i = 0; i < messagesCount; i++)
+    {
+        const char *sender = FindUsername(USERS, messages[i].senderId);
+        messages[i].sender = sender != NULL ? ArenaStrdup(&requestArena, sender) : NULL;
+        if (messages[i].sender == NULL)
+        {
+            return -1;
+        }
     }
 
-    fclose(file);
-    return 1;
+    return 0;
 }
 
-void LogEvent(int clientId, const char *event)
+int FileExists(const char *filename)
+{
+    return access(filename, F_OK) != -1;
+}
+
+int CreateFile()
 {
     time_t currentTime;
     struct tm timeInfo;
@@ -799,69 +1382,59 @@ void LogEvent(int clientId, const char *event)
 
     localtime_r(&currentTime, &timeInfo);
 
-    strftime(timeString, 50, "%H:%M:%S", &timeInfo);
+    strftime(timeString, 50, "%Y-%m-%d_%H:%M:%S", &timeInfo);
 
-    int len = snprintf(NULL, 0, "[Client %d][%s] - %s\n", clientId, timeString, event);
+    int len = snprintf(NULL, 0, "%s%s_LOGS.txt", FILENAME_FOLDER, timeString);
     if (len <= 0)
     {
-        printf("[SERVER][ERROR][Client %d] Log Write error.\n", clientId);
-        return;
+        return 0;
     }
 
-    char *eventLog = NULL;
-    eventLog = (char *)malloc(len + 1);
-    snprintf(eventLog, len + 1, "[Client %d][%s] - %s\n", clientId, timeString, event);
-
-    pthread_mutex_lock(&fileMutex);
-
-    FILE *file = fopen(FILE_NAME, "a");
-    if (file == NULL)
-    {
-        free(eventLog);
-        printf("[SERVER][ERROR][Client %d] Log Write error.\n", clientId);
-        return;
-    }
+    FILE_NAME = (char *)malloc(len + 1);
+    snprintf(FILE_NAME, len + 1, "%s%s_LOGS.txt", FILENAME_FOLDER, timeString);
 
-    fprintf(file, "%s", eventLog);
-    fclose(file);
-    pthread_mutex_unlock(&fileMutex);
+    LOGS = CreateLogger(FILE_NAME, LOG_FLUSH_INTERVAL_US);
+    return LOGS != NULL;
+}
 
-    free(eventLog);
-    return;
+void LogEvent(int clientId, const char *event)
+{
+    WriteLog(LOGS, clientId, "%s", event);
 }
 
-void LogRequestEvent(int clientId, const ClientRequest clientRequestStructure)
+void LogRequestEvent(int clientId, const RequestFields *request)
 {
-    int len = snprintf(NULL, 0, "[REQUEST] - [Auth: %d][Command: %s][Content: %s]", clientRequestStructure.authorized,
-                       clientRequestStructure.command, clientRequestStructure.content);
-    if (len <= 0)
+    // The log entry is truncated anyway, so the content is too
+    char content[LOG_ENTRY_SIZE];
+    int offset = 0;
+
+    // Binary number fields are logged as their value
+    for (int i = 0; i < request->fieldsCount && offset < (int)sizeof(content) - 1; i++)
     {
-        return;
-    }
+        if (request->binary && request->fields[i].length == 4)
+        {
+            offset += snprintf(content + offset, sizeof(content) - offset, "%d#", GetIntField(request, i));
+            continue;
+        }
 
-    char *event = NULL;
-    event = (char *)malloc(len + 1);
-    snprintf(event, len + 1, "[REQUEST] - [Auth: %d][Command: %s][Content: %s]", clientRequestStructure.authorized, clientRequestStructure.command,
-             clientRequestStructure.content);
+        offset += snprintf(content + offset, sizeof(content) - offset, "%s#", request->fields[i].data);
+    }
+    content[offset < (int)sizeof(content) ? offset : (int)sizeof(content) - 1] = '\0';
 
-    LogEvent(clientId, event);
-    free(event);
+    const char *command = request->commandNumber >= 0 ? commands[request->commandNumber] : "Unknown";
+    WriteLog(LOGS, clientId, "[REQUEST] - [Auth: %d][Command: %s][Content: %s]", request->authorized, command, content);
 }
 
 void LogResponseEvent(int clientId, const ServerResponse serverResponseStructure)
 {
-    int len = snprintf(NULL, 0, "[RESPONSE] - [Status: %d][Content: %s]", serverResponseStructure.status,
-                       serverResponseStructure.content);
-    if (len <= 0)
+    // List responses are logged by their rows count
+    char rows[32];
+    const char *content = serverResponseStructure.content;
+    if (serverResponseStructure.messages != NULL || serverResponseStructure.users != NULL)
     {
-        return;
+        snprintf(rows, sizeof(rows), "%d rows", serverResponseStructure.rowsCount);
+        content = rows;
     }
 
-    char *event = NULL;
-    event = (char *)malloc(len + 1);
-    snprintf(event, len + 1, "[RESPONSE] - [Status: %d][Content: %s]", serverResponseStructure.status,
-             serverResponseStructure.content);
-
-    LogEvent(clientId, event);
-    free(event);
+    WriteLog(LOGS, clientId, "[RESPONSE] - [Status: %d][Content: %s]", serverResponseStructure.status, content);
 }
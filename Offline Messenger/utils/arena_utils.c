@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "arena_utils.h"
+
+#define ARENA_ALIGNMENT 8
+
+static ArenaBlock *AddBlock(Arena *arena, size_t size)
+{
+    size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    ArenaBlock *block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + capacity);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    block->next = NULL;
+    block->capacity = capacity;
+    block->used = 0;
+
+    if (arena->current == NULL)
+    {
+        arena->first = block;
+    }
+    else
+    {
+        arena->current->next = block;
+    }
+    arena->current = block;
+    return block;
+}
+
+void *ArenaAlloc(Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    ArenaBlock *block = arena->current;
+    if (block == NULL || block->capacity - block->used < size)
+    {
+        block = AddBlock(arena, size);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    void *memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+char *ArenaStrdup(Arena *arena, const char *text)
+{
+    size_t length = strlen(text);
+    char *copy = (char *)ArenaAlloc(arena, length + 1);
+    if (copy != NULL)
+    {
+        memcpy(copy, text, length + 1);
+    }
+
+    return copy;
+}
+
+// Formats straight into the current block, sizing the text first only when it doesn't fit.
+char *ArenaPrintf(Arena *arena, const char *format, ...)
+{
+    va_list args;
+    ArenaBlock *block = arena->current;
+    size_t available = block != NULL ? block->capacity - block->used : 0;
+
+    va_start(args, format);
+    int length = vsnprintf(available > 0 ? block->data + block->used : NULL, available, format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        return NULL;
+    }
+
+    if ((size_t)length < available)
+    {
+        return (char *)ArenaAlloc(arena, length + 1);
+    }
+
+    char *text = (char *)ArenaAlloc(arena, length + 1);
+    if (text == NULL)
+    {
+        return NULL;
+    }
+
+    va_start(args, format);
+    vsnprintf(text, length + 1, format, args);
+    va_end(args);
+    return text;
+}
+
+void ResetArena(Arena *arena)
+{
+    if (arena->first == NULL)
+    {
+        return;
+    }
+
+    ArenaBlock *block = arena->first->next;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
+
+void FreeArena(Arena *arena)
+{
+    ResetArena(arena);
+    free(arena->first);
+    arena->first = NULL;
+    arena->current = NULL;
+}
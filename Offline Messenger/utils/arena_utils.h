@@ -0,0 +1,30 @@
+#ifndef ARENA_UTILS_H
+#define ARENA_UTILS_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t capacity;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator for the memory of one request: nothing is freed on its own, ResetArena releases everything at once.
+// The first block is kept across resets, so a request that fits in it doesn't call malloc. A zeroed Arena is empty.
+typedef struct Arena
+{
+    ArenaBlock *first;
+    ArenaBlock *current;
+} Arena;
+
+void *ArenaAlloc(Arena *arena, size_t size);
+char *ArenaStrdup(Arena *arena, const char *text);
+char *ArenaPrintf(Arena *arena, const char *format, ...);
+void ResetArena(Arena *arena);
+void FreeArena(Arena *arena);
+
+#endif
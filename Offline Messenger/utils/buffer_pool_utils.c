@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "buffer_pool_utils.h"
+
+typedef struct PooledBuffer
+{
+    struct PooledBuffer *next;
+    int sizeClass;
+    int capacity;
+    char data[];
+} PooledBuffer;
+
+typedef struct BufferClass
+{
+    pthread_mutex_t mutex;
+    PooledBuffer *free;
+    int freeCount;
+} BufferClass;
+
+static BufferClass classes[BUFFER_POOL_CLASSES] = {
+    [0 ... BUFFER_POOL_CLASSES - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL, 0}};
+
+static int ClassCapacity(int sizeClass)
+{
+    return BUFFER_POOL_MIN_SIZE << (2 * sizeClass);
+}
+
+static int MaxFreeCount(int sizeClass)
+{
+    int count = BUFFER_POOL_CLASS_BYTES / ClassCapacity(sizeClass);
+    return count > 2 ? count : 2;
+}
+
+// Returns a buffer of at least size bytes and its actual capacity, or NULL when out of memory.
+char *LeaseBuffer(int size, int *capacity)
+{
+    int sizeClass = 0;
+    while (sizeClass < BUFFER_POOL_CLASSES && ClassCapacity(sizeClass) < size)
+    {
+        sizeClass++;
+    }
+
+    PooledBuffer *buffer = NULL;
+    if (sizeClass < BUFFER_POOL_CLASSES)
+    {
+        BufferClass *bufferClass = &classes[sizeClass];
+        pthread_mutex_lock(&bufferClass->mutex);
+        buffer = bufferClass->free;
+        if (buffer != NULL)
+        {
+            bufferClass->free = buffer->next;
+            bufferClass->freeCount--;
+        }
+        pthread_mutex_unlock(&bufferClass->mutex);
+
+        if (buffer == NULL)
+        {
+            buffer = (PooledBuffer *)malloc(sizeof(PooledBuffer) + ClassCapacity(sizeClass));
+            if (buffer == NULL)
+            {
+                return NULL;
+            }
+            buffer->sizeClass = sizeClass;
+            buffer->capacity = ClassCapacity(sizeClass);
+        }
+    }
+    else
+    {
+        buffer = (PooledBuffer *)malloc(sizeof(PooledBuffer) + size);
+        if (buffer == NULL)
+        {
+            return NULL;
+        }
+        buffer->sizeClass = -1;
+        buffer->capacity = size;
+    }
+
+    buffer->next = NULL;
+    *capacity = buffer->capacity;
+    return buffer->data;
+}
+
+// Accepts NULL. Buffers over the class limit or larger than every class are freed.
+void ReturnBuffer(char *data)
+{
+    if (data == NULL)
+    {
+        return;
+    }
+
+    PooledBuffer *buffer = (PooledBuffer *)(data - offsetof(PooledBuffer, data));
+    if (buffer->sizeClass == -1)
+    {
+        free(buffer);
+        return;
+    }
+
+    BufferClass *bufferClass = &classes[buffer->sizeClass];
+    pthread_mutex_lock(&bufferClass->mutex);
+    if (bufferClass->freeCount < MaxFreeCount(buffer->sizeClass))
+    {
+        buffer->next = bufferClass->free;
+        bufferClass->free = buffer;
+        bufferClass->freeCount++;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&bufferClass->mutex);
+
+    free(buffer);
+}
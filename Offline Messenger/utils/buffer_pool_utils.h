@@ -0,0 +1,15 @@
+#ifndef BUFFER_POOL_UTILS_H
+#define BUFFER_POOL_UTILS_H
+
+// Size classes of 1 KB, 4 KB, ... 1 MB; larger buffers are allocated and freed directly.
+#define BUFFER_POOL_CLASSES 6
+#define BUFFER_POOL_MIN_SIZE 1024
+// Free buffers kept per class, as a number of bytes; the smaller the class, the more buffers are kept.
+#define BUFFER_POOL_CLASS_BYTES (4 * 1024 * 1024)
+
+// Buffers shared by every connection and thread of the process: a buffer is leased when bytes have to be held
+// and returned as soon as they are not, so a connection waiting for its next request holds none.
+char *LeaseBuffer(int size, int *capacity);
+void ReturnBuffer(char *buffer);
+
+#endif
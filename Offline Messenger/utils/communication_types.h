@@ -1,6 +1,13 @@
 #ifndef COMMUNICATION_TYPES_H
 #define COMMUNICATION_TYPES_H
 
+// Command numbers of the list requests, the index of their name in commands[]
+#define COMMAND_VIEW_MESSAGES 3
+#define COMMAND_VIEW_USERS 4
+#define COMMAND_VIEW_MESSAGES_BEFORE 9
+#define COMMAND_VIEW_USERS_AFTER 10
+#define COMMAND_SYNC_MESSAGES 14
+
 typedef struct ClientRequest
 {
     unsigned short int authorized;
@@ -8,15 +15,10 @@ typedef struct ClientRequest
     char *content;
 } ClientRequest;
 
-typedef struct ServerResponse
-{
-    int status;
-    char *content;
-} ServerResponse;
-
 typedef struct MessageStructure
 {
     int id;
+    int senderId;
     char *sender;
     char *message;
     int read;
@@ -29,4 +31,96 @@ typedef struct UserViewStructure
     int unreadMessagesCount;
 } UserViewStructure;
 
+// What a client needs besides the new messages to bring its copy of a conversation up to date.
+// Read flags follow from the watermarks: a message is read when its id is up to the receiver's watermark.
+typedef struct SyncState
+{
+    int messagesCount;
+    int readWatermark;
+    int peerReadWatermark;
+} SyncState;
+
+// List responses carry their rows instead of a preformatted content, so each protocol can encode them.
+// Sync_Messages responses also carry the sync state, encoded before the rows.
+typedef struct ServerResponse
+{
+    int status;
+    char *content;
+    int rowsCount;
+    MessageStructure *messages;
+    UserViewStructure *users;
+    SyncState *sync;
+} ServerResponse;
+
+// A view into a received request. Text fields are NUL terminated; binary number fields are 4 big endian bytes.
+// Encoders treat a field with data == NULL as the number field.
+typedef struct ProtocolField
+{
+    const char *data;
+    int length;
+    int number;
+} ProtocolField;
+
+#define MAX_REQUEST_FIELDS 32
+
+typedef struct RequestFields
+{
+    unsigned short int authorized;
+    unsigned short int binary;
+    int commandNumber;
+    int fieldsCount;
+    ProtocolField fields[MAX_REQUEST_FIELDS];
+} RequestFields;
+
+// Frames are a 4 byte big endian payload length followed by the payload.
+// Peers that send unframed text (first byte not 0) are served one request per read, as before.
+#define FRAME_HEADER_SIZE 4
+#define MAX_FRAME_SIZE (16 * 1024 * 1024)
+
+#define FRAME_MODE_UNKNOWN 0
+#define FRAME_MODE_LEGACY 1
+#define FRAME_MODE_LENGTH_PREFIXED 2
+#define FRAME_MODE_BINARY 3
+
+// Binary protocol: a 12 byte header (version, opcode, flags, request id, payload length, big endian)
+// followed by the payload. Fields are a 4 byte length, the bytes and a NUL, so they can be used in place.
+// Request payloads are the fields; response payloads are a 2 byte status, a 4 byte fields count and the fields.
+// Opcodes are the command numbers, OPCODE_HELLO negotiates the version when the client connects.
+#define BINARY_PROTOCOL_VERSION 1
+#define BINARY_HEADER_SIZE 12
+#define BINARY_FLAG_RESPONSE 0x0001
+#define BINARY_FLAG_AUTHORIZED 0x0002
+#define OPCODE_HELLO 0x7F
+
+typedef struct BinaryHeader
+{
+    unsigned char version;
+    unsigned char opcode;
+    unsigned short int flags;
+    unsigned int requestId;
+    unsigned int payloadLength;
+} BinaryHeader;
+
+typedef struct FrameBuffer
+{
+    char *data;
+    int length;
+    int capacity;
+    int mode;
+    int frameEnd;
+    char savedByte;
+} FrameBuffer;
+
+#define OUTPUT_BUFFER_SIZE 1024
+
+// Encoders append to it in one pass, growing it as needed. After a failed allocation the appends are skipped
+// and failed stays set until the buffer is freed.
+typedef struct OutputBuffer
+{
+    char *data;
+    int length;
+    int capacity;
+    int failed;
+} OutputBuffer;
+
 #endif
\ No newline at end of file
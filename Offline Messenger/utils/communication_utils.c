@@ -1,10 +1,33 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "communication_types.h"
+#include "communication_utils.h"
+#include "buffer_pool_utils.h"
 
-const char *commands[] = {"Login", "Register", "Quit", "View_Messages", "View_Users", "Get_Users_Count", "Get_Messages_Count", "Insert_Message", "Update_Message_Read"};
+#define RECEIVE_CHUNK_SIZE 8192
+
+const char *commands[] = {"Login", "Register", "Quit", "View_Messages", "View_Users", "Get_Users_Count", "Get_Messages_Count", "Insert_Message", "Update_Message_Read",
+                          "View_Messages_Before", "View_Users_After", "Mark_Conversation_Read", "Logout", "Get_Cache_Stats",
+                          "Sync_Messages", NULL};
+
+#define MESSAGE_ROW_FIELDS 5
+#define USER_ROW_FIELDS 2
+#define SYNC_STATE_FIELDS 3
+
+int IsMessagesListCommand(int commandNumber)
+{
+    return commandNumber == COMMAND_VIEW_MESSAGES || commandNumber == COMMAND_VIEW_MESSAGES_BEFORE || commandNumber == COMMAND_SYNC_MESSAGES;
+}
+
+int IsUsersListCommand(int commandNumber)
+{
+    return commandNumber == COMMAND_VIEW_USERS || commandNumber == COMMAND_VIEW_USERS_AFTER;
+}
 
 int RetrieveCommandNumber(const char *command)
 {
@@ -25,32 +48,31 @@ int RetrieveCommandNumber(const char *command)
     return -1;
 }
 
+// The Create functions return buffers leased from the buffer pool, given back with ReturnBuffer.
 char *CreateClientRequest(const char *command, const char *content, int authorized)
 {
-    char *result = NULL;
-    int len = snprintf(NULL, 0, "%d:%s:%s", authorized, command, content);
+    OutputBuffer buffer;
+    InitOutputBuffer(&buffer, OUTPUT_BUFFER_SIZE);
+    AppendInt(&buffer, authorized);
+    AppendChar(&buffer, ':');
+    AppendString(&buffer, command);
+    AppendChar(&buffer, ':');
+    AppendString(&buffer, content);
 
-    if (len > 0)
-    {
-        result = (char *)malloc(len + 1);
-        snprintf(result, len + 1, "%d:%s:%s", authorized, command, content);
-    }
-
-    return result;
+    int length;
+    return DetachOutputBuffer(&buffer, &length);
 }
 
 char *CreateServerResponse(int status, const char *content)
 {
-    char *result = NULL;
-    int len = snprintf(NULL, 0, "%d:%s", status, content);
-
-    if (len > 0)
-    {
-        result = (char *)malloc(len + 1);
-        snprintf(result, len + 1, "%d:%s", status, content);
-    }
+    OutputBuffer buffer;
+    InitOutputBuffer(&buffer, OUTPUT_BUFFER_SIZE);
+    AppendInt(&buffer, status);
+    AppendChar(&buffer, ':');
+    AppendString(&buffer, content);
 
-    return result;
+    int length;
+    return DetachOutputBuffer(&buffer, &length);
 }
 
 ClientRequest ParseClientRequest(const char *request)
@@ -96,9 +118,8 @@ ClientRequest ParseClientRequest(const char *request)
 
 ServerResponse ParseServerResponse(const char *response)
 {
-    struct ServerResponse responseStructure;
+    struct ServerResponse responseStructure = {0};
     responseStructure.status = 500;
-    responseStructure.content = NULL;
 
     if (response == NULL)
     {
@@ -256,4 +277,968 @@ char **ParseContent(const char *content, int *numberOfInputs)
     }
 
     return result;
-}
\ No newline at end of file
+}
+
+unsigned int ReadUInt32(const char *data)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    return ((unsigned int)bytes[0] << 24) | ((unsigned int)bytes[1] << 16) |
+           ((unsigned int)bytes[2] << 8) | (unsigned int)bytes[3];
+}
+
+void WriteUInt32(char *data, unsigned int value)
+{
+    data[0] = (char)((value >> 24) & 0xFF);
+    data[1] = (char)((value >> 16) & 0xFF);
+    data[2] = (char)((value >> 8) & 0xFF);
+    data[3] = (char)(value & 0xFF);
+}
+
+void InitFrameBuffer(FrameBuffer *buffer, int mode)
+{
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+    buffer->mode = mode;
+    buffer->frameEnd = 0;
+    buffer->savedByte = 0;
+}
+
+// Returns the data to the buffer pool; the mode is kept, the buffer can be reused.
+void FreeFrameBuffer(FrameBuffer *buffer)
+{
+    ReturnBuffer(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+// Makes room for length more bytes, plus one so a frame can always be terminated in place.
+// The data is leased from the buffer pool and moved to a larger class when it grows.
+int ReserveFrameBuffer(FrameBuffer *buffer, int length)
+{
+    int required = buffer->length + length + 1;
+    if (required <= buffer->capacity)
+    {
+        return 0;
+    }
+
+    // At least doubles, so reassembling a large frame isn't copied again on every received chunk
+    int capacity;
+    char *data = LeaseBuffer(required > 2 * buffer->capacity ? required : 2 * buffer->capacity, &capacity);
+    if (data == NULL)
+    {
+        return -1;
+    }
+
+    if (buffer->length > 0)
+    {
+        memcpy(data, buffer->data, buffer->length);
+    }
+    ReturnBuffer(buffer->data);
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+int AppendToFrameBuffer(FrameBuffer *buffer, const char *data, int length)
+{
+    if (ReserveFrameBuffer(buffer, length) != 0)
+    {
+        return -1;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return 0;
+}
+
+// Returns the next complete payload, NUL terminated in place, or NULL when more bytes are needed.
+// frameLength is set to -1 when the peer announced a frame larger than MAX_FRAME_SIZE.
+char *NextFrame(FrameBuffer *buffer, int *frameLength)
+{
+    *frameLength = 0;
+    if (buffer->length == 0)
+    {
+        return NULL;
+    }
+
+    if (buffer->mode == FRAME_MODE_UNKNOWN)
+    {
+        if (buffer->data[0] == 0)
+        {
+            buffer->mode = FRAME_MODE_LENGTH_PREFIXED;
+        }
+        else if (buffer->data[0] == BINARY_PROTOCOL_VERSION)
+        {
+            buffer->mode = FRAME_MODE_BINARY;
+        }
+        else
+        {
+            buffer->mode = FRAME_MODE_LEGACY;
+        }
+    }
+
+    if (buffer->mode == FRAME_MODE_LEGACY)
+    {
+        buffer->frameEnd = buffer->length;
+        buffer->savedByte = 0;
+        buffer->data[buffer->length] = '\0';
+
+        *frameLength = buffer->length;
+        return buffer->data;
+    }
+
+    // Binary frames are returned with their header, which the binary parsers read
+    int headerSize = buffer->mode == FRAME_MODE_BINARY ? BINARY_HEADER_SIZE : FRAME_HEADER_SIZE;
+    if (buffer->length < headerSize)
+    {
+        return NULL;
+    }
+
+    unsigned int payloadLength = ReadUInt32(buffer->data + headerSize - 4);
+    if (payloadLength > MAX_FRAME_SIZE)
+    {
+        *frameLength = -1;
+        return NULL;
+    }
+
+    if (buffer->length < headerSize + (int)payloadLength)
+    {
+        return NULL;
+    }
+
+    buffer->frameEnd = headerSize + payloadLength;
+    buffer->savedByte = buffer->data[buffer->frameEnd];
+    buffer->data[buffer->frameEnd] = '\0';
+
+    if (buffer->mode == FRAME_MODE_BINARY)
+    {
+        *frameLength = buffer->frameEnd;
+        return buffer->data;
+    }
+
+    *frameLength = payloadLength;
+    return buffer->data + FRAME_HEADER_SIZE;
+}
+
+// Drops the frame returned by the last NextFrame call and restores the byte its terminator replaced.
+// Once nothing is left buffered the data goes back to the pool.
+void ConsumeFrame(FrameBuffer *buffer)
+{
+    if (buffer->frameEnd == 0)
+    {
+        return;
+    }
+
+    buffer->data[buffer->frameEnd] = buffer->savedByte;
+    buffer->length -= buffer->frameEnd;
+    if (buffer->length > 0)
+    {
+        memmove(buffer->data, buffer->data + buffer->frameEnd, buffer->length);
+    }
+    else
+    {
+        FreeFrameBuffer(buffer);
+    }
+    buffer->frameEnd = 0;
+}
+
+char *CreateFrame(const char *payload, int payloadLength, int *frameLength)
+{
+    int capacity;
+    char *frame = LeaseBuffer(FRAME_HEADER_SIZE + payloadLength + 1, &capacity);
+    if (frame == NULL)
+    {
+        return NULL;
+    }
+
+    WriteUInt32(frame, payloadLength);
+    memcpy(frame + FRAME_HEADER_SIZE, payload, payloadLength);
+    frame[FRAME_HEADER_SIZE + payloadLength] = '\0';
+
+    *frameLength = FRAME_HEADER_SIZE + payloadLength;
+    return frame;
+}
+
+void InitOutputBuffer(OutputBuffer *buffer, int capacity)
+{
+    buffer->data = LeaseBuffer(capacity, &buffer->capacity);
+    buffer->length = 0;
+    buffer->failed = buffer->data == NULL;
+    if (buffer->failed)
+    {
+        buffer->capacity = 0;
+    }
+}
+
+void FreeOutputBuffer(OutputBuffer *buffer)
+{
+    ReturnBuffer(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+// Makes room for length more bytes, plus one for the terminator added by DetachOutputBuffer.
+int ReserveOutputBuffer(OutputBuffer *buffer, int length)
+{
+    if (buffer->failed)
+    {
+        return -1;
+    }
+
+    int required = buffer->length + length + 1;
+    if (required <= buffer->capacity)
+    {
+        return 0;
+    }
+
+    // At least doubles, so a buffer much larger than the pooled classes isn't copied on every append
+    int capacity;
+    char *data = LeaseBuffer(required > 2 * buffer->capacity ? required : 2 * buffer->capacity, &capacity);
+    if (data == NULL)
+    {
+        buffer->failed = 1;
+        return -1;
+    }
+
+    memcpy(data, buffer->data, buffer->length);
+    ReturnBuffer(buffer->data);
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+void AppendBytes(OutputBuffer *buffer, const char *data, int length)
+{
+    if (ReserveOutputBuffer(buffer, length) != 0)
+    {
+        return;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+void AppendString(OutputBuffer *buffer, const char *text)
+{
+    AppendBytes(buffer, text, strlen(text));
+}
+
+void AppendChar(OutputBuffer *buffer, char character)
+{
+    if (ReserveOutputBuffer(buffer, 1) != 0)
+    {
+        return;
+    }
+
+    buffer->data[buffer->length++] = character;
+}
+
+// Writes the decimal digits backwards into a small scratch, without going through the printf machinery.
+void AppendInt(OutputBuffer *buffer, int value)
+{
+    char digits[12];
+    int position = sizeof(digits);
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+    do
+    {
+        digits[--position] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    if (value < 0)
+    {
+        digits[--position] = '-';
+    }
+
+    AppendBytes(buffer, digits + position, sizeof(digits) - position);
+}
+
+// Big endian, like every length and number of the wire format.
+void AppendUInt32(OutputBuffer *buffer, unsigned int value)
+{
+    if (ReserveOutputBuffer(buffer, 4) != 0)
+    {
+        return;
+    }
+
+    WriteUInt32(buffer->data + buffer->length, value);
+    buffer->length += 4;
+}
+
+// Hands over the NUL terminated data, to be given back with ReturnBuffer, or returns NULL when an append failed.
+char *DetachOutputBuffer(OutputBuffer *buffer, int *length)
+{
+    if (buffer->failed)
+    {
+        FreeOutputBuffer(buffer);
+        *length = 0;
+        return NULL;
+    }
+
+    char *data = buffer->data;
+    data[buffer->length] = '\0';
+    *length = buffer->length;
+
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+    return data;
+}
+
+// Reserves the length prefix of a frame whose payload is appended next, EndFrame fills it in.
+int BeginFrame(OutputBuffer *buffer)
+{
+    int frameStart = buffer->length;
+    AppendUInt32(buffer, 0);
+    return frameStart;
+}
+
+void EndFrame(OutputBuffer *buffer, int frameStart)
+{
+    if (!buffer->failed)
+    {
+        WriteUInt32(buffer->data + frameStart, buffer->length - frameStart - FRAME_HEADER_SIZE);
+    }
+}
+
+int SendAll(int socket, const char *data, int length)
+{
+    int offset = 0;
+    while (offset < length)
+    {
+        ssize_t noOfBytesSent = send(socket, data + offset, length - offset, MSG_NOSIGNAL);
+        if (noOfBytesSent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        offset += noOfBytesSent;
+    }
+
+    return 0;
+}
+
+// Blocks until a whole frame is buffered. Returns NULL with frameLength 0 when the peer closed the connection
+// and -1 on errors. The frame stays valid until ConsumeFrame is called.
+// Bytes are received on the stack and buffered once they arrived, so no buffer is held while waiting.
+char *ReceiveFrame(int socket, FrameBuffer *buffer, int *frameLength)
+{
+    char chunk[RECEIVE_CHUNK_SIZE];
+
+    while (1)
+    {
+        char *frame = NextFrame(buffer, frameLength);
+        if (frame != NULL || *frameLength == -1)
+        {
+            return frame;
+        }
+
+        ssize_t noOfBytesRead = recv(socket, chunk, sizeof(chunk), 0);
+        if (noOfBytesRead == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            *frameLength = -1;
+            return NULL;
+        }
+        else if (noOfBytesRead == 0)
+        {
+            *frameLength = 0;
+            return NULL;
+        }
+
+        if (AppendToFrameBuffer(buffer, chunk, noOfBytesRead) != 0)
+        {
+            *frameLength = -1;
+            return NULL;
+        }
+    }
+}
+static int AddRequestField(RequestFields *request, const char *data, int length)
+{
+    if (request->fieldsCount == MAX_REQUEST_FIELDS)
+    {
+        return -1;
+    }
+
+    ProtocolField *field = &request->fields[request->fieldsCount++];
+    field->data = data;
+    field->length = length;
+    field->number = 0;
+    return 0;
+}
+
+// Splits "authorized:command:field#field#..." in a single pass without allocating: the delimiters are
+// replaced by NULs and the fields point into request, which must be NUL terminated at requestLength.
+// A content without '#' is a single field.
+int ParseRequestFields(char *request, int requestLength, RequestFields *fields)
+{
+    fields->authorized = 0;
+    fields->binary = 0;
+    fields->commandNumber = -1;
+    fields->fieldsCount = 0;
+
+    char *end = request + requestLength;
+    char *cursor = request;
+    while (cursor < end && *cursor >= '0' && *cursor <= '9')
+    {
+        if (*cursor != '0')
+        {
+            fields->authorized = 1;
+        }
+        cursor++;
+    }
+
+    if (cursor == request || cursor == end || *cursor != ':')
+    {
+        return -1;
+    }
+
+    char *command = ++cursor;
+    while (cursor < end && *cursor != ':')
+    {
+        cursor++;
+    }
+
+    if (cursor == end)
+    {
+        return -1;
+    }
+    *cursor++ = '\0';
+    fields->commandNumber = RetrieveCommandNumber(command);
+
+    char *field = cursor;
+    for (; cursor < end; cursor++)
+    {
+        if (*cursor == '#')
+        {
+            *cursor = '\0';
+            if (AddRequestField(fields, field, cursor - field) != 0)
+            {
+                return -1;
+            }
+            field = cursor + 1;
+        }
+    }
+
+    if (field < end)
+    {
+        return AddRequestField(fields, field, end - field);
+    }
+
+    return 0;
+}
+
+int GetIntField(const RequestFields *request, int index)
+{
+    if (index < 0 || index >= request->fieldsCount)
+    {
+        return -1;
+    }
+
+    const ProtocolField *field = &request->fields[index];
+    if (request->binary)
+    {
+        return field->length == 4 ? (int)ReadUInt32(field->data) : -1;
+    }
+
+    return atoi(field->data);
+}
+
+// "authorized:command:field#field#...". Fields are '#' terminated, so a lone empty field is still sent.
+void AppendTextRequest(OutputBuffer *buffer, const char *command, int authorized, const ProtocolField *fields, int fieldsCount)
+{
+    AppendInt(buffer, authorized);
+    AppendChar(buffer, ':');
+    AppendString(buffer, command);
+    AppendChar(buffer, ':');
+    for (int i = 0; i < fieldsCount; i++)
+    {
+        if (fields[i].data == NULL)
+        {
+            AppendInt(buffer, fields[i].number);
+        }
+        else
+        {
+            AppendBytes(buffer, fields[i].data, fields[i].length);
+        }
+        AppendChar(buffer, '#');
+    }
+}
+
+char *CreateTextRequest(const char *command, int authorized, const ProtocolField *fields, int fieldsCount)
+{
+    OutputBuffer buffer;
+    InitOutputBuffer(&buffer, OUTPUT_BUFFER_SIZE);
+    AppendTextRequest(&buffer, command, authorized, fields, fieldsCount);
+
+    int length;
+    return DetachOutputBuffer(&buffer, &length);
+}
+
+// Text encoding of a response: "status:content", list rows are '|' separated fields terminated by '#'.
+// The sync state is a first row "messagesCount|readWatermark|peerReadWatermark|#".
+void AppendServerResponse(OutputBuffer *buffer, const ServerResponse *response)
+{
+    AppendInt(buffer, response->status);
+    AppendChar(buffer, ':');
+
+    if (response->sync != NULL)
+    {
+        AppendInt(buffer, response->sync->messagesCount);
+        AppendChar(buffer, '|');
+        AppendInt(buffer, response->sync->readWatermark);
+        AppendChar(buffer, '|');
+        AppendInt(buffer, response->sync->peerReadWatermark);
+        AppendBytes(buffer, "|#", 2);
+    }
+
+    if (response->messages == NULL && response->users == NULL)
+    {
+        if (response->content != NULL)
+        {
+            AppendString(buffer, response->content);
+        }
+        return;
+    }
+
+    for (int i = 0; i < response->rowsCount; i++)
+    {
+        if (response->messages != NULL)
+        {
+            const MessageStructure *message = &response->messages[i];
+            AppendInt(buffer, message->id);
+            AppendChar(buffer, '|');
+            AppendString(buffer, message->sender);
+            AppendChar(buffer, '|');
+            AppendString(buffer, message->message);
+            AppendChar(buffer, '|');
+            AppendInt(buffer, message->read);
+            AppendChar(buffer, '|');
+            AppendInt(buffer, message->replyId);
+            AppendChar(buffer, '#');
+        }
+        else
+        {
+            AppendString(buffer, response->users[i].username);
+            AppendChar(buffer, '|');
+            AppendInt(buffer, response->users[i].unreadMessagesCount);
+            AppendBytes(buffer, "|#", 2);
+        }
+    }
+}
+
+// Moves the rows of a text list response from content into messages or users.
+int ParseResponseRows(ServerResponse *response, int commandNumber)
+{
+    if (response->status != 200 || response->content == NULL ||
+        (!IsMessagesListCommand(commandNumber) && !IsUsersListCommand(commandNumber)))
+    {
+        return 0;
+    }
+
+    int rowsCount = 0;
+    char **rows = ParseContent(response->content, &rowsCount);
+    if (rows == NULL)
+    {
+        rowsCount = 0;
+    }
+
+    int first = 0;
+    if (commandNumber == COMMAND_SYNC_MESSAGES)
+    {
+        response->sync = (SyncState *)malloc(sizeof(SyncState));
+        if (response->sync == NULL || rowsCount == 0 ||
+            sscanf(rows[0], "%d|%d|%d|", &response->sync->messagesCount, &response->sync->readWatermark,
+                   &response->sync->peerReadWatermark) != SYNC_STATE_FIELDS)
+        {
+            free(response->sync);
+            response->sync = NULL;
+            FreeParsedStrings(rows, rowsCount);
+            return -1;
+        }
+        first = 1;
+    }
+
+    if (IsMessagesListCommand(commandNumber))
+    {
+        response->messages = (MessageStructure *)malloc((rowsCount + 1) * sizeof(MessageStructure));
+    }
+    else
+    {
+        response->users = (UserViewStructure *)malloc((rowsCount + 1) * sizeof(UserViewStructure));
+    }
+
+    if (response->messages == NULL && response->users == NULL)
+    {
+        FreeParsedStrings(rows, rowsCount);
+        return -1;
+    }
+
+    for (int i = first; i < rowsCount; i++)
+    {
+        if (IsMessagesListCommand(commandNumber))
+        {
+            response->messages[i - first] = ParseMessage(rows[i]);
+        }
+        else
+        {
+            response->users[i] = ParseUserViewStructure(rows[i]);
+        }
+    }
+    response->rowsCount = rowsCount - first;
+
+    FreeParsedStrings(rows, rowsCount);
+    free(response->content);
+    response->content = NULL;
+    return 0;
+}
+
+void FreeResponseRows(ServerResponse *response)
+{
+    for (int i = 0; i < response->rowsCount; i++)
+    {
+        if (response->messages != NULL)
+        {
+            free(response->messages[i].sender);
+            free(response->messages[i].message);
+        }
+        if (response->users != NULL)
+        {
+            free(response->users[i].username);
+        }
+    }
+
+    free(response->messages);
+    free(response->users);
+    free(response->sync);
+    response->messages = NULL;
+    response->users = NULL;
+    response->sync = NULL;
+    response->rowsCount = 0;
+}
+
+// Binary protocol
+void WriteBinaryHeader(char *data, const BinaryHeader *header)
+{
+    data[0] = (char)header->version;
+    data[1] = (char)header->opcode;
+    data[2] = (char)((header->flags >> 8) & 0xFF);
+    data[3] = (char)(header->flags & 0xFF);
+    WriteUInt32(data + 4, header->requestId);
+    WriteUInt32(data + 8, header->payloadLength);
+}
+
+void ParseBinaryHeader(const char *data, BinaryHeader *header)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    header->version = bytes[0];
+    header->opcode = bytes[1];
+    header->flags = (unsigned short int)((bytes[2] << 8) | bytes[3]);
+    header->requestId = ReadUInt32(data + 4);
+    header->payloadLength = ReadUInt32(data + 8);
+}
+
+static void AppendBinaryField(OutputBuffer *buffer, const char *data, int length)
+{
+    AppendUInt32(buffer, length);
+    AppendBytes(buffer, data, length);
+    AppendChar(buffer, '\0');
+}
+
+static void AppendBinaryNumberField(OutputBuffer *buffer, int number)
+{
+    AppendUInt32(buffer, 4);
+    AppendUInt32(buffer, (unsigned int)number);
+    AppendChar(buffer, '\0');
+}
+
+// The header is written once the payload is appended and its length known.
+static void EndBinaryFrame(OutputBuffer *buffer, int frameStart, BinaryHeader *header)
+{
+    if (!buffer->failed)
+    {
+        header->payloadLength = buffer->length - frameStart - BINARY_HEADER_SIZE;
+        WriteBinaryHeader(buffer->data + frameStart, header);
+    }
+}
+
+// Returns the field at *offset and moves past it, or NULL when the payload is malformed.
+static const char *NextBinaryField(const char *payload, int payloadLength, int *offset, int *fieldLength)
+{
+    if (payloadLength - *offset < 5)
+    {
+        return NULL;
+    }
+
+    unsigned int length = ReadUInt32(payload + *offset);
+    if (length > (unsigned int)(payloadLength - *offset - 5) || payload[*offset + 4 + length] != '\0')
+    {
+        return NULL;
+    }
+
+    const char *field = payload + *offset + 4;
+    *fieldLength = length;
+    *offset += length + 5;
+    return field;
+}
+
+void AppendBinaryRequest(OutputBuffer *buffer, int opcode, int authorized, unsigned int requestId, const ProtocolField *fields,
+                         int fieldsCount)
+{
+    int frameStart = buffer->length;
+    if (ReserveOutputBuffer(buffer, BINARY_HEADER_SIZE) == 0)
+    {
+        buffer->length += BINARY_HEADER_SIZE;
+    }
+
+    for (int i = 0; i < fieldsCount; i++)
+    {
+        if (fields[i].data == NULL)
+        {
+            AppendBinaryNumberField(buffer, fields[i].number);
+        }
+        else
+        {
+            AppendBinaryField(buffer, fields[i].data, fields[i].length);
+        }
+    }
+
+    BinaryHeader header;
+    header.version = BINARY_PROTOCOL_VERSION;
+    header.opcode = opcode;
+    header.flags = authorized ? BINARY_FLAG_AUTHORIZED : 0;
+    header.requestId = requestId;
+    EndBinaryFrame(buffer, frameStart, &header);
+}
+
+char *CreateBinaryRequest(int opcode, int authorized, unsigned int requestId, const ProtocolField *fields, int fieldsCount,
+                          int *requestLength)
+{
+    OutputBuffer buffer;
+    InitOutputBuffer(&buffer, OUTPUT_BUFFER_SIZE);
+    AppendBinaryRequest(&buffer, opcode, authorized, requestId, fields, fieldsCount);
+
+    return DetachOutputBuffer(&buffer, requestLength);
+}
+
+// Fills request with views into frame, which must stay alive while the fields are used.
+int ParseBinaryRequest(const char *frame, int frameLength, BinaryHeader *header, RequestFields *request)
+{
+    if (frameLength < BINARY_HEADER_SIZE)
+    {
+        return -1;
+    }
+
+    ParseBinaryHeader(frame, header);
+
+    int commandsCount = sizeof(commands) / sizeof(commands[0]) - 1;
+    request->authorized = (header->flags & BINARY_FLAG_AUTHORIZED) != 0;
+    request->binary = 1;
+    request->commandNumber = header->opcode < commandsCount ? header->opcode : -1;
+    request->fieldsCount = 0;
+
+    const char *payload = frame + BINARY_HEADER_SIZE;
+    int payloadLength = frameLength - BINARY_HEADER_SIZE;
+    int offset = 0;
+    while (offset < payloadLength)
+    {
+        if (request->fieldsCount == MAX_REQUEST_FIELDS)
+        {
+            return -1;
+        }
+
+        ProtocolField *field = &request->fields[request->fieldsCount];
+        field->data = NextBinaryField(payload, payloadLength, &offset, &field->length);
+        if (field->data == NULL)
+        {
+            return -1;
+        }
+        field->number = 0;
+        request->fieldsCount++;
+    }
+
+    return 0;
+}
+
+void AppendBinaryResponse(OutputBuffer *buffer, const BinaryHeader *requestHeader, const ServerResponse *response)
+{
+    int fieldsCount = 0;
+    if (response->messages != NULL)
+    {
+        fieldsCount = response->rowsCount * MESSAGE_ROW_FIELDS;
+    }
+    else if (response->users != NULL)
+    {
+        fieldsCount = response->rowsCount * USER_ROW_FIELDS;
+    }
+    else if (response->content != NULL)
+    {
+        fieldsCount = 1;
+    }
+    if (response->sync != NULL)
+    {
+        fieldsCount += SYNC_STATE_FIELDS;
+    }
+
+    int frameStart = buffer->length;
+    if (ReserveOutputBuffer(buffer, BINARY_HEADER_SIZE) == 0)
+    {
+        buffer->length += BINARY_HEADER_SIZE;
+    }
+
+    AppendChar(buffer, (char)((response->status >> 8) & 0xFF));
+    AppendChar(buffer, (char)(response->status & 0xFF));
+    AppendUInt32(buffer, fieldsCount);
+
+    if (response->sync != NULL)
+    {
+        AppendBinaryNumberField(buffer, response->sync->messagesCount);
+        AppendBinaryNumberField(buffer, response->sync->readWatermark);
+        AppendBinaryNumberField(buffer, response->sync->peerReadWatermark);
+    }
+
+    for (int i = 0; i < response->rowsCount; i++)
+    {
+        if (response->messages != NULL)
+        {
+            const MessageStructure *message = &response->messages[i];
+            AppendBinaryNumberField(buffer, message->id);
+            AppendBinaryField(buffer, message->sender, strlen(message->sender));
+            AppendBinaryField(buffer, message->message, strlen(message->message));
+            AppendBinaryNumberField(buffer, message->read);
+            AppendBinaryNumberField(buffer, message->replyId);
+        }
+        else if (response->users != NULL)
+        {
+            AppendBinaryField(buffer, response->users[i].username, strlen(response->users[i].username));
+            AppendBinaryNumberField(buffer, response->users[i].unreadMessagesCount);
+        }
+    }
+    if (fieldsCount == 1 && response->content != NULL)
+    {
+        AppendBinaryField(buffer, response->content, strlen(response->content));
+    }
+
+    BinaryHeader header;
+    header.version = BINARY_PROTOCOL_VERSION;
+    header.opcode = requestHeader->opcode;
+    header.flags = BINARY_FLAG_RESPONSE;
+    header.requestId = requestHeader->requestId;
+    EndBinaryFrame(buffer, frameStart, &header);
+}
+
+static int BinaryNumber(const char *field, int fieldLength)
+{
+    return field != NULL && fieldLength == 4 ? (int)ReadUInt32(field) : -1;
+}
+
+// List rows are decoded by the opcode the server echoed; other responses carry their content as one field.
+ServerResponse ParseBinaryServerResponse(const char *frame, int frameLength)
+{
+    struct ServerResponse responseStructure = {0};
+    responseStructure.status = 500;
+
+    BinaryHeader header;
+    if (frameLength < BINARY_HEADER_SIZE + 6)
+    {
+        return responseStructure;
+    }
+    ParseBinaryHeader(frame, &header);
+
+    const char *payload = frame + BINARY_HEADER_SIZE;
+    int payloadLength = frameLength - BINARY_HEADER_SIZE;
+    int status = (((unsigned char)payload[0]) << 8) | (unsigned char)payload[1];
+    int fieldsCount = ReadUInt32(payload + 2);
+    int offset = 6;
+    int length;
+
+    // Sync_Messages responses start with the sync state fields
+    if (status == 200 && header.opcode == COMMAND_SYNC_MESSAGES)
+    {
+        if (fieldsCount < SYNC_STATE_FIELDS || (responseStructure.sync = (SyncState *)malloc(sizeof(SyncState))) == NULL)
+        {
+            return responseStructure;
+        }
+
+        const char *field = NextBinaryField(payload, payloadLength, &offset, &length);
+        responseStructure.sync->messagesCount = BinaryNumber(field, length);
+        field = NextBinaryField(payload, payloadLength, &offset, &length);
+        responseStructure.sync->readWatermark = BinaryNumber(field, length);
+        field = NextBinaryField(payload, payloadLength, &offset, &length);
+        responseStructure.sync->peerReadWatermark = BinaryNumber(field, length);
+        fieldsCount -= SYNC_STATE_FIELDS;
+    }
+
+    if (status == 200 && IsMessagesListCommand(header.opcode) && fieldsCount % MESSAGE_ROW_FIELDS == 0)
+    {
+        int rowsCount = fieldsCount / MESSAGE_ROW_FIELDS;
+        responseStructure.messages = (MessageStructure *)malloc((rowsCount + 1) * sizeof(MessageStructure));
+        for (int i = 0; i < rowsCount && responseStructure.messages != NULL; i++)
+        {
+            MessageStructure *message = &responseStructure.messages[i];
+            const char *field = NextBinaryField(payload, payloadLength, &offset, &length);
+            message->id = BinaryNumber(field, length);
+            field = NextBinaryField(payload, payloadLength, &offset, &length);
+            message->sender = field != NULL ? strdup(field) : NULL;
+            field = NextBinaryField(payload, payloadLength, &offset, &length);
+            message->message = field != NULL ? strdup(field) : NULL;
+            field = NextBinaryField(payload, payloadLength, &offset, &length);
+            message->read = BinaryNumber(field, length);
+            field = NextBinaryField(payload, payloadLength, &offset, &length);
+            message->replyId = BinaryNumber(field, length);
+            responseStructure.rowsCount++;
+
+            if (message->sender == NULL || message->message == NULL)
+            {
+                FreeResponseRows(&responseStructure);
+                return responseStructure;
+            }
+        }
+    }
+    else if (status == 200 && IsUsersListCommand(header.opcode) && fieldsCount % USER_ROW_FIELDS == 0)
+    {
+        int rowsCount = fieldsCount / USER_ROW_FIELDS;
+        responseStructure.users = (UserViewStructure *)malloc((rowsCount + 1) * sizeof(UserViewStructure));
+        for (int i = 0; i < rowsCount && responseStructure.users != NULL; i++)
+        {
+            UserViewStructure *user = &responseStructure.users[i];
+            const char *field = NextBinaryField(payload, payloadLength, &offset, &length);
+            user->username = field != NULL ? strdup(field) : NULL;
+            field = NextBinaryField(payload, payloadLength, &offset, &length);
+            user->unreadMessagesCount = BinaryNumber(field, length);
+            responseStructure.rowsCount++;
+
+            if (user->username == NULL)
+            {
+                FreeResponseRows(&responseStructure);
+                return responseStructure;
+            }
+        }
+    }
+    else if (fieldsCount > 0)
+    {
+        const char *field = NextBinaryField(payload, payloadLength, &offset, &length);
+        if (field == NULL)
+        {
+            return responseStructure;
+        }
+        responseStructure.content = strdup(field);
+    }
+
+    responseStructure.status = status;
+    return responseStructure;
+}
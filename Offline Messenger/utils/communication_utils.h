@@ -3,7 +3,11 @@
 
 #include "communication_types.h"
 
+extern const char *commands[];
+
 int RetrieveCommandNumber(const char *command);
+int IsMessagesListCommand(int commandNumber);
+int IsUsersListCommand(int commandNumber);
 char *CreateClientRequest(const char *command, const char *content, int authorized);
 char *CreateServerResponse(int status, const char *content);
 ClientRequest ParseClientRequest(const char *request);
@@ -13,4 +17,47 @@ MessageStructure ParseMessage(const char *message);
 UserViewStructure ParseUserViewStructure(const char *row);
 void FreeParsedStrings(char **strings, int numStrings);
 
+int ParseRequestFields(char *request, int requestLength, RequestFields *fields);
+int GetIntField(const RequestFields *request, int index);
+void AppendTextRequest(OutputBuffer *buffer, const char *command, int authorized, const ProtocolField *fields, int fieldsCount);
+char *CreateTextRequest(const char *command, int authorized, const ProtocolField *fields, int fieldsCount);
+void AppendServerResponse(OutputBuffer *buffer, const ServerResponse *response);
+int ParseResponseRows(ServerResponse *response, int commandNumber);
+void FreeResponseRows(ServerResponse *response);
+
+void WriteBinaryHeader(char *data, const BinaryHeader *header);
+void ParseBinaryHeader(const char *data, BinaryHeader *header);
+void AppendBinaryRequest(OutputBuffer *buffer, int opcode, int authorized, unsigned int requestId, const ProtocolField *fields,
+                         int fieldsCount);
+char *CreateBinaryRequest(int opcode, int authorized, unsigned int requestId, const ProtocolField *fields, int fieldsCount,
+                          int *requestLength);
+int ParseBinaryRequest(const char *frame, int frameLength, BinaryHeader *header, RequestFields *request);
+void AppendBinaryResponse(OutputBuffer *buffer, const BinaryHeader *requestHeader, const ServerResponse *response);
+ServerResponse ParseBinaryServerResponse(const char *frame, int frameLength);
+
+unsigned int ReadUInt32(const char *data);
+void WriteUInt32(char *data, unsigned int value);
+
+void InitFrameBuffer(FrameBuffer *buffer, int mode);
+void FreeFrameBuffer(FrameBuffer *buffer);
+int ReserveFrameBuffer(FrameBuffer *buffer, int length);
+int AppendToFrameBuffer(FrameBuffer *buffer, const char *data, int length);
+char *NextFrame(FrameBuffer *buffer, int *frameLength);
+void ConsumeFrame(FrameBuffer *buffer);
+char *CreateFrame(const char *payload, int payloadLength, int *frameLength);
+
+void InitOutputBuffer(OutputBuffer *buffer, int capacity);
+void FreeOutputBuffer(OutputBuffer *buffer);
+int ReserveOutputBuffer(OutputBuffer *buffer, int length);
+void AppendBytes(OutputBuffer *buffer, const char *data, int length);
+void AppendString(OutputBuffer *buffer, const char *text);
+void AppendChar(OutputBuffer *buffer, char character);
+void AppendInt(OutputBuffer *buffer, int value);
+void AppendUInt32(OutputBuffer *buffer, unsigned int value);
+char *DetachOutputBuffer(OutputBuffer *buffer, int *length);
+int BeginFrame(OutputBuffer *buffer);
+void EndFrame(OutputBuffer *buffer, int frameStart);
+int SendAll(int socket, const char *data, int length);
+char *ReceiveFrame(int socket, FrameBuffer *buffer, int *frameLength);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,59 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "communication_utils.h"
+#include "connection_utils.h"
+#include "buffer_pool_utils.h"
+
+static int clientIdCounter = 0;
+
+int NextClientId()
+{
+    return __sync_fetch_and_add(&clientIdCounter, 1);
+}
+
+Connection *CreateConnection(int socket)
+{
+    Connection *connection = (Connection *)malloc(sizeof(Connection));
+    if (connection == NULL)
+    {
+        return NULL;
+    }
+
+    connection->clientId = NextClientId();
+    connection->socket = socket;
+    connection->watchedEvents = 0;
+    InitFrameBuffer(&connection->input, FRAME_MODE_UNKNOWN);
+    connection->output = NULL;
+    connection->outputLength = 0;
+    connection->outputOffset = 0;
+    memset(&connection->requestHeader, 0, sizeof(BinaryHeader));
+    connection->request.fieldsCount = 0;
+    connection->session.userId = 0;
+    connection->complete = NULL;
+    connection->owner = NULL;
+    connection->nextCompleted = NULL;
+    connection->busy = 0;
+    connection->closing = 0;
+    connection->pendingOperations = 0;
+    InitFrameBuffer(&connection->pendingInput, FRAME_MODE_UNKNOWN);
+    connection->receiveArmed = 0;
+    connection->receivePaused = 0;
+
+    return connection;
+}
+
+void FreeConnection(Connection *connection)
+{
+    if (connection == NULL)
+    {
+        return;
+    }
+
+    close(connection->socket);
+    FreeFrameBuffer(&connection->input);
+    FreeFrameBuffer(&connection->pendingInput);
+    ReturnBuffer(connection->output);
+    free(connection);
+}
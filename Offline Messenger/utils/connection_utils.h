@@ -0,0 +1,48 @@
+#ifndef CONNECTION_UTILS_H
+#define CONNECTION_UTILS_H
+
+#include "communication_types.h"
+
+// The user logged in on the connection, set by a successful Login or Register; userId is 0 while logged out.
+typedef struct Session
+{
+    int userId;
+} Session;
+
+typedef struct Connection
+{
+    int clientId;
+    int socket;
+    unsigned int watchedEvents;
+    FrameBuffer input;
+    char *output;
+    int outputLength;
+    int outputOffset;
+
+    // The request in flight, parsed in place: its fields point into input until the frame is consumed.
+    BinaryHeader requestHeader;
+    RequestFields request;
+
+    // Only the worker running the connection's in-flight request reads or changes it.
+    Session session;
+
+    // Set by the I/O mode that owns the connection; called once the response of the in-flight request is ready.
+    // A NULL response means no response could be encoded and the connection is closed.
+    void (*complete)(struct Connection *connection, char *response, int responseLength);
+    void *owner;
+    struct Connection *nextCompleted;
+    int busy;
+    int closing;
+    int pendingOperations;
+
+    // io_uring: bytes received while the connection isn't idle wait here, since input can't move under the request.
+    FrameBuffer pendingInput;
+    int receiveArmed;
+    int receivePaused;
+} Connection;
+
+Connection *CreateConnection(int socket);
+void FreeConnection(Connection *connection);
+int NextClientId();
+
+#endif
@@ -2,374 +2,802 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
 #include "../sql/sqlite3.h"
+#include "communication_types.h"
+#include "database_utils.h"
 
-int CreateDatabase(sqlite3 **db, const char *databaseName)
+typedef struct Migration
+{
+    int version;
+    const char *description;
+    const char *sql;
+} Migration;
+
+// The conversation id of two users, the same whatever their order; the length prefix keeps it unambiguous
+#define CONVERSATION_ID(first, second) \
+    "(CASE WHEN " first " < " second " THEN length(" first ") || ':' || " first " || " second " " \
+    "ELSE length(" second ") || ':' || " second " || " first " END)"
+
+// The conversation id of two user ids: the lower id in the high 32 bits, the higher one in the low bits
+#define USERS_PAIR_ID(first, second) \
+    "(CASE WHEN " first " < " second " THEN (" first " << 32) | " second " ELSE (" second " << 32) | " first " END)"
+
+// Applied in order by MigrateDatabase; append new versions at the end and never edit an applied one.
+static const Migration migrations[] = {
+    {1, "Create users and messages tables",
+     "CREATE TABLE IF NOT EXISTS users(username VARCHAR(255) PRIMARY KEY UNIQUE, first_name VARCHAR(255), last_name VARCHAR(255), password VARCHAR(255));"
+     "CREATE TABLE IF NOT EXISTS messages(id INTEGER PRIMARY KEY, sender VARCHAR(255), receiver VARCHAR(255), message VARCHAR(255), read INTEGER, replyId INTEGER);"},
+    {2, "Index messages by conversation",
+     "CREATE INDEX IF NOT EXISTS messages_sender_receiver_id ON messages(sender, receiver, id);"
+     "CREATE INDEX IF NOT EXISTS messages_receiver_sender_read ON messages(receiver, sender, read);"},
+    // Read state becomes one watermark per conversation side: the messages from peer with an id up to last_read_id are read.
+    // The watermark starts before the first unread message, so messages read after it count as unread again.
+    {3, "Track read state per conversation",
+     "CREATE TABLE IF NOT EXISTS conversation_state(reader VARCHAR(255) NOT NULL, peer VARCHAR(255) NOT NULL, last_read_id INTEGER NOT NULL, "
+     "PRIMARY KEY(reader, peer)) WITHOUT ROWID;"
+     "INSERT OR IGNORE INTO conversation_state(reader, peer, last_read_id) "
+     "SELECT receiver, sender, COALESCE(MIN(CASE WHEN read = 0 THEN id END) - 1, MAX(id)) FROM messages GROUP BY receiver, sender;"
+     "DROP INDEX IF EXISTS messages_receiver_sender_read;"},
+    // Unread counts are kept up to date by the message inserts and the watermark moves, so pages read them instead of counting.
+    {4, "Keep unread counts per conversation",
+     "ALTER TABLE conversation_state ADD COLUMN unread_count INTEGER NOT NULL DEFAULT 0;"
+     "UPDATE conversation_state SET unread_count = "
+     "(SELECT COUNT(*) FROM messages WHERE sender = peer AND receiver = reader AND id > last_read_id);"},
+    {5, "Group messages by conversation id",
+     "ALTER TABLE messages ADD COLUMN conversation_id TEXT;"
+     "UPDATE messages SET conversation_id = " CONVERSATION_ID("sender", "receiver") ";"
+     "CREATE INDEX IF NOT EXISTS messages_conversation_id ON messages(conversation_id, id);"},
+    // Users get integer ids and the other tables reference them instead of repeating the usernames.
+    // Messages and read states of usernames missing from users can't be mapped and are dropped.
+    {6, "Reference users by integer id",
+     "CREATE TABLE users_v6(id INTEGER PRIMARY KEY, username VARCHAR(255) NOT NULL UNIQUE, first_name VARCHAR(255), last_name VARCHAR(255), "
+     "password VARCHAR(255));"
+     "INSERT INTO users_v6(id, username, first_name, last_name, password) SELECT rowid, username, first_name, last_name, password FROM users;"
+     "CREATE TABLE messages_v6(id INTEGER PRIMARY KEY, sender_id INTEGER NOT NULL, receiver_id INTEGER NOT NULL, conversation_id INTEGER NOT NULL, "
+     "message VARCHAR(255), replyId INTEGER);"
+     "INSERT INTO messages_v6(id, sender_id, receiver_id, conversation_id, message, replyId) "
+     "SELECT m.id, s.id, r.id, " USERS_PAIR_ID("s.id", "r.id") ", m.message, m.replyId "
+     "FROM messages m JOIN users_v6 s ON s.username = m.sender JOIN users_v6 r ON r.username = m.receiver;"
+     "CREATE TABLE conversation_state_v6(reader_id INTEGER NOT NULL, peer_id INTEGER NOT NULL, last_read_id INTEGER NOT NULL, "
+     "unread_count INTEGER NOT NULL DEFAULT 0, PRIMARY KEY(reader_id, peer_id)) WITHOUT ROWID;"
+     "INSERT INTO conversation_state_v6(reader_id, peer_id, last_read_id, unread_count) SELECT r.id, p.id, c.last_read_id, c.unread_count "
+     "FROM conversation_state c JOIN users_v6 r ON r.username = c.reader JOIN users_v6 p ON p.username = c.peer;"
+     "DROP TABLE conversation_state;"
+     "DROP TABLE messages;"
+     "DROP TABLE users;"
+     "ALTER TABLE users_v6 RENAME TO users;"
+     "ALTER TABLE messages_v6 RENAME TO messages;"
+     "ALTER TABLE conversation_state_v6 RENAME TO conversation_state;"
+     "CREATE INDEX messages_sender_receiver_id ON messages(sender_id, receiver_id, id);"
+     "CREATE INDEX messages_conversation_id ON messages(conversation_id, id);"}};
+
+static double ElapsedMilliseconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static int GetSchemaVersion(sqlite3 *db)
+{
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(db, "SELECT COALESCE(MAX(version), 0) FROM schema_version", -1, &stmt, NULL);
+    if (rc != SQLITE_OK)
+    {
+        return -1;
+    }
+
+    int version = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+// Brings the schema to the latest version, each migration in its own transaction.
+int MigrateDatabase(sqlite3 *db)
 {
     char *err;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    sqlite3_open(databaseName, db);
-    int rc = sqlite3_exec(*db, "CREATE TABLE IF NOT EXISTS users(username VARCHAR(255) PRIMARY KEY UNIQUE, first_name VARCHAR(255), last_name VARCHAR(255), password VARCHAR(255));", NULL, NULL, &err);
+    int rc = sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS schema_version(version INTEGER PRIMARY KEY, description TEXT, applied_at INTEGER);", NULL, NULL, &err);
     if (rc != SQLITE_OK)
     {
-        printf("[Error][Database] CREATE TABLE <USERS>: %s\n", err);
+        printf("[Error][Database] CREATE TABLE <SCHEMA_VERSION>: %s\n", err);
         fflush(stdout);
+        sqlite3_free(err);
         return -1;
     }
 
-    rc = sqlite3_exec(*db, "CREATE TABLE IF NOT EXISTS messages(id INTEGER PRIMARY KEY, sender VARCHAR(255), receiver VARCHAR(255), message VARCHAR(255), read INTEGER, replyId INTEGER);", NULL, NULL, &err);
-    if (rc != SQLITE_OK)
+    int version = GetSchemaVersion(db);
+    if (version < 0)
     {
-        printf("[Error][Database] CREATE TABLE <MESSAGES>: %s\n", err);
+        printf("[Error][Database] Schema version query error: %s\n", sqlite3_errmsg(db));
         fflush(stdout);
         return -1;
     }
 
+    int appliedCount = 0;
+    int migrationsCount = sizeof(migrations) / sizeof(migrations[0]);
+    for (int i = 0; i < migrationsCount; i++)
+    {
+        if (migrations[i].version <= version)
+        {
+            continue;
+        }
+
+        struct timespec migrationStart;
+        clock_gettime(CLOCK_MONOTONIC, &migrationStart);
+
+        sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+        rc = sqlite3_exec(db, migrations[i].sql, NULL, NULL, &err);
+        if (rc == SQLITE_OK)
+        {
+            char *query = sqlite3_mprintf("INSERT INTO schema_version VALUES(%d, '%q', strftime('%%s', 'now'));",
+                                          migrations[i].version, migrations[i].description);
+            rc = sqlite3_exec(db, query, NULL, NULL, &err);
+            sqlite3_free(query);
+        }
+
+        if (rc != SQLITE_OK)
+        {
+            printf("[Error][Database] Migration %d (%s) error: %s\n", migrations[i].version, migrations[i].description, err);
+            fflush(stdout);
+            sqlite3_free(err);
+
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+            return -1;
+        }
+        sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+
+        printf("[Database] Migration %d (%s) applied in %.2f ms\n", migrations[i].version, migrations[i].description,
+               ElapsedMilliseconds(&migrationStart));
+        version = migrations[i].version;
+        appliedCount++;
+    }
+
+    printf("[Database] Schema at version %d, %d migrations applied in %.2f ms\n", version, appliedCount, ElapsedMilliseconds(&start));
+    fflush(stdout);
     return 0;
 }
 
-int OpenDatabase(sqlite3 **db, const char *databaseName)
+// WAL lets the read-only connections read while the writer commits.
+static int EnableWriteAheadLog(sqlite3 *db)
 {
     char *err;
 
-    int rc = sqlite3_open(databaseName, db);
+    sqlite3_busy_timeout(db, 5000);
+    int rc = sqlite3_exec(db, "PRAGMA journal_mode=WAL;", NULL, NULL, &err);
     if (rc != SQLITE_OK)
     {
-        printf("[Error][Database] Open Database Error: %s\n", err);
+        printf("[Error][Database] Enable WAL error: %s\n", err);
         fflush(stdout);
-        sqlite3_close(*db);
+        sqlite3_free(err);
         return -1;
     }
 
     return 0;
 }
 
-int GetUsersCount(sqlite3 *db)
+int CreateDatabase(sqlite3 **db, const char *databaseName)
 {
-    sqlite3_stmt *stmt;
-    char *err;
-
-    int rc = sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM users", -1, &stmt, NULL);
+    int rc = sqlite3_open(databaseName, db);
     if (rc != SQLITE_OK)
     {
-        printf("[Error][Database] Users count query prepare error: %s\n", err);
+        printf("[Error][Database] Create Database Error: %s\n", sqlite3_errmsg(*db));
         fflush(stdout);
+        sqlite3_close(*db);
         return -1;
     }
 
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW)
+    if (EnableWriteAheadLog(*db) != 0)
     {
-        printf("[Error][Database] Users count query execute error: %s\n", err);
-        fflush(stdout);
         return -1;
     }
-    int usersCount = sqlite3_column_int(stmt, 0);
-
-    sqlite3_clear_bindings(stmt);
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
 
-    return usersCount;
+    return MigrateDatabase(*db);
 }
 
-int GetUsersCountByUsername(sqlite3 *db, const char *username)
+// Existing databases are upgraded in place to the latest schema version.
+int OpenDatabase(sqlite3 **db, const char *databaseName)
 {
-    sqlite3_stmt *stmt;
-    char *err;
-
-    int rc = sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM users WHERE username=?", -1, &stmt, NULL);
+    int rc = sqlite3_open(databaseName, db);
     if (rc != SQLITE_OK)
     {
-        printf("[Error][Database] Users count by username query prepare error: %s\n", err);
+        printf("[Error][Database] Open Database Error: %s\n", sqlite3_errmsg(*db));
         fflush(stdout);
+        sqlite3_close(*db);
         return -1;
     }
 
-    rc = sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW)
+    if (EnableWriteAheadLog(*db) != 0)
     {
-        printf("[Error][Database] Users count query execute error: %s\n", err);
-        fflush(stdout);
         return -1;
     }
-    int usersCount = sqlite3_column_int(stmt, 0);
 
-    sqlite3_clear_bindings(stmt);
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
-
-    return usersCount;
+    return MigrateDatabase(*db);
 }
 
-int GetUsersCountByUsernameAndPassword(sqlite3 *db, const char *username, const char *password)
+// Readers are used by a single worker each, so they skip SQLite's connection mutex.
+int OpenReadOnlyDatabase(sqlite3 **db, const char *databaseName)
 {
-    sqlite3_stmt *stmt;
-    char *err;
-
-    int rc = sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM users WHERE username=? AND password=?", -1, &stmt, NULL);
+    int rc = sqlite3_open_v2(databaseName, db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
     if (rc != SQLITE_OK)
     {
-        printf("[Error][Database] Users count by username and password query prepare error: %s\n", err);
+        printf("[Error][Database] Open Read Only Database Error: %s\n", sqlite3_errmsg(*db));
         fflush(stdout);
+        sqlite3_close(*db);
         return -1;
     }
 
-    rc = sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-    rc = sqlite3_bind_text(stmt, 2, password, -1, SQLITE_STATIC);
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW)
+    sqlite3_busy_timeout(*db, 5000);
+    return 0;
+}
+
+// The writer connection is shared by every worker; each worker thread binds one reader on first use.
+DatabasePool *CreateDatabasePool(sqlite3 *writer, const char *databaseName, int readersCount)
+{
+    DatabasePool *pool = (DatabasePool *)calloc(1, sizeof(DatabasePool));
+    if (pool == NULL)
     {
-        printf("[Error][Database] Users count by username and password query execute error: %s\n", err);
-        fflush(stdout);
-        return -1;
+        return NULL;
     }
-    int usersCount = sqlite3_column_int(stmt, 0);
 
-    sqlite3_clear_bindings(stmt);
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
+    pool->readers = (DatabaseConnection **)calloc(readersCount, sizeof(DatabaseConnection *));
+    pool->writer = CreateDatabaseConnection(writer);
+    if (pool->readers == NULL || pool->writer == NULL)
+    {
+        FreeDatabasePool(pool);
+        return NULL;
+    }
+
+    for (int i = 0; i < readersCount; i++)
+    {
+        sqlite3 *reader;
+        if (OpenReadOnlyDatabase(&reader, databaseName) != 0)
+        {
+            FreeDatabasePool(pool);
+            return NULL;
+        }
+
+        pool->readers[i] = CreateDatabaseConnection(reader);
+        if (pool->readers[i] == NULL)
+        {
+            sqlite3_close(reader);
+            FreeDatabasePool(pool);
+            return NULL;
+        }
+        pool->readersCount++;
+    }
 
-    return usersCount;
+    return pool;
 }
 
-int GetUsernamesWhereNotEqualUsername(sqlite3 *db, char **usernames, const char *username, const int page)
+void FreeDatabasePool(DatabasePool *pool)
 {
-    sqlite3_stmt *stmt;
-    char *err;
+    if (pool == NULL)
+    {
+        return;
+    }
 
-    const int PAGE_SIZE = 10;
-    int offset = (page - 1) * PAGE_SIZE;
+    for (int i = 0; i < pool->readersCount; i++)
+    {
+        sqlite3 *db = pool->readers[i]->db;
+        FreeDatabaseConnection(pool->readers[i]);
+        sqlite3_close(db);
+    }
+    free(pool->readers);
+    FreeDatabaseConnection(pool->writer);
+    free(pool);
+}
 
-    int rc = sqlite3_prepare_v2(db, "SELECT username FROM users WHERE username!=? LIMIT ? OFFSET ?", -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
+static __thread DatabaseConnection *threadReader = NULL;
+
+// Threads beyond the readers count share the writer connection.
+DatabaseConnection *ReaderConnection(DatabasePool *pool)
+{
+    if (threadReader == NULL)
+    {
+        int index = __sync_fetch_and_add(&pool->nextReader, 1);
+        threadReader = index < pool->readersCount ? pool->readers[index] : pool->writer;
+    }
+
+    return threadReader;
+}
+
+// A message is read when its id is up to the receiver's watermark, ?1 and ?2 being the two users of the conversation
+#define MESSAGE_COLUMNS \
+    "id, sender_id, receiver_id, message, id <= COALESCE(CASE WHEN receiver_id = ?1 " \
+    "THEN (SELECT last_read_id FROM conversation_state WHERE reader_id = ?1 AND peer_id = ?2) " \
+    "ELSE (SELECT last_read_id FROM conversation_state WHERE reader_id = ?2 AND peer_id = ?1) END, 0), replyId"
+
+static const char *statementsSql[STATEMENTS_COUNT] = {
+    "SELECT u.username, COALESCE(c.unread_count, 0) FROM users u LEFT JOIN conversation_state c ON c.reader_id = ?1 AND c.peer_id = u.id "
+    "WHERE u.id != ?1 LIMIT ?2 OFFSET ?3",
+    "SELECT COUNT(*) FROM messages WHERE conversation_id = " USERS_PAIR_ID("?1", "?2"),
+    "SELECT " MESSAGE_COLUMNS " FROM messages WHERE conversation_id = " USERS_PAIR_ID("?1", "?2") " ORDER BY id DESC LIMIT ?3 OFFSET ?4",
+    "INSERT INTO users(username, first_name, last_name, password) VALUES(?, ?, ?, ?)",
+    "INSERT INTO messages(sender_id, receiver_id, conversation_id, message, replyId) VALUES(?1, ?2, " USERS_PAIR_ID("?1", "?2") ", ?3, ?4)",
+    "INSERT INTO conversation_state(reader_id, peer_id, last_read_id, unread_count) "
+    "SELECT receiver_id, sender_id, id, "
+    "(SELECT COUNT(*) FROM messages u WHERE u.sender_id = m.sender_id AND u.receiver_id = m.receiver_id AND u.id > m.id) "
+    "FROM messages m WHERE m.id = ?2 AND m.receiver_id = ?1 "
+    "ON CONFLICT(reader_id, peer_id) DO UPDATE SET last_read_id = excluded.last_read_id, unread_count = excluded.unread_count "
+    "WHERE excluded.last_read_id > last_read_id",
+    "SELECT u.username, COALESCE(c.unread_count, 0) FROM users u LEFT JOIN conversation_state c ON c.reader_id = ?2 AND c.peer_id = u.id "
+    "WHERE u.username > ?1 AND u.id != ?2 ORDER BY u.username LIMIT ?3",
+    // One range scan on messages(conversation_id, id) that stops after a page
+    "SELECT " MESSAGE_COLUMNS " FROM messages WHERE conversation_id = " USERS_PAIR_ID("?1", "?2") " AND id < ?3 ORDER BY id DESC LIMIT ?4",
+    // The watermark only moves forward and never past the newest message received from peer
+    "WITH watermark(id) AS (SELECT MIN(?3, (SELECT COALESCE(MAX(id), 0) FROM messages WHERE sender_id = ?2 AND receiver_id = ?1))) "
+    "INSERT INTO conversation_state(reader_id, peer_id, last_read_id, unread_count) "
+    "SELECT ?1, ?2, w.id, (SELECT COUNT(*) FROM messages WHERE sender_id = ?2 AND receiver_id = ?1 AND id > w.id) FROM watermark w WHERE 1 "
+    "ON CONFLICT(reader_id, peer_id) DO UPDATE SET last_read_id = excluded.last_read_id, unread_count = excluded.unread_count "
+    "WHERE excluded.last_read_id > last_read_id",
+    "INSERT INTO conversation_state(reader_id, peer_id, last_read_id, unread_count) VALUES(?1, ?2, 0, 1) "
+    "ON CONFLICT(reader_id, peer_id) DO UPDATE SET unread_count = unread_count + 1",
+    "SELECT " MESSAGE_COLUMNS " FROM messages WHERE conversation_id = " USERS_PAIR_ID("?1", "?2") " AND id > ?3 ORDER BY id DESC LIMIT ?4",
+    // The count and both watermarks in one statement, so they come from the same snapshot
+    "SELECT (SELECT COUNT(*) FROM messages WHERE conversation_id = " USERS_PAIR_ID("?1", "?2") "), "
+    "COALESCE((SELECT last_read_id FROM conversation_state WHERE reader_id = ?1 AND peer_id = ?2), 0), "
+    "COALESCE((SELECT last_read_id FROM conversation_state WHERE reader_id = ?2 AND peer_id = ?1), 0)"};
+
+// Prepares every statement once; the connection's statements are reused under its mutex.
+DatabaseConnection *CreateDatabaseConnection(sqlite3 *db)
+{
+    DatabaseConnection *connection = (DatabaseConnection *)calloc(1, sizeof(DatabaseConnection));
+    if (connection == NULL)
+    {
+        return NULL;
+    }
+
+    connection->db = db;
+    pthread_mutex_init(&connection->mutex, NULL);
+    for (int i = 0; i < STATEMENTS_COUNT; i++)
+    {
+        int rc = sqlite3_prepare_v3(db, statementsSql[i], -1, SQLITE_PREPARE_PERSISTENT, &connection->statements[i], NULL);
+        if (rc != SQLITE_OK)
+        {
+            printf("[Error][Database] Statement prepare error: %s\n", sqlite3_errmsg(db));
+            fflush(stdout);
+            FreeDatabaseConnection(connection);
+            return NULL;
+        }
+    }
+
+    return connection;
+}
+
+void FreeDatabaseConnection(DatabaseConnection *connection)
+{
+    if (connection == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < STATEMENTS_COUNT; i++)
+    {
+        sqlite3_finalize(connection->statements[i]);
+    }
+    pthread_mutex_destroy(&connection->mutex);
+    free(connection);
+}
+
+static sqlite3_stmt *AcquireStatement(DatabaseConnection *connection, int statement)
+{
+    pthread_mutex_lock(&connection->mutex);
+    return connection->statements[statement];
+}
+
+static void ReleaseStatement(DatabaseConnection *connection, sqlite3_stmt *stmt)
+{
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    pthread_mutex_unlock(&connection->mutex);
+}
+
+// Runs a statement returning a single integer, -1 on errors.
+static int StepCount(DatabaseConnection *connection, sqlite3_stmt *stmt, const char *errorMessage)
+{
+    int count = -1;
+
+    int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW)
     {
-        printf("[Error][Database] GET usernames query prepare error: %s\n", err);
+        printf("[Error][Database] %s: %s\n", errorMessage, sqlite3_errmsg(connection->db));
         fflush(stdout);
-        return -1;
+    }
+    else
+    {
+        count = sqlite3_column_int(stmt, 0);
     }
 
-    rc = sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
-    rc = sqlite3_bind_int(stmt, 2, PAGE_SIZE);
-    rc = sqlite3_bind_int(stmt, 3, offset);
+    ReleaseStatement(connection, stmt);
+    return count;
+}
 
+// Steps a users query into users, releasing the statement. The usernames are allocated in arena.
+// Returns the rows count or -1.
+static int ReadUsers(DatabaseConnection *connection, sqlite3_stmt *stmt, Arena *arena, UserViewStructure *users)
+{
     int i = 0;
-    rc = sqlite3_step(stmt);
+    int rc = sqlite3_step(stmt);
     while (rc == SQLITE_ROW)
     {
-        usernames[i] = strdup((char *)sqlite3_column_text(stmt, 0));
-        usernames[i][strlen(usernames[i])] = '\0';
+        users[i].username = ArenaStrdup(arena, (char *)sqlite3_column_text(stmt, 0));
+        users[i].unreadMessagesCount = sqlite3_column_int(stmt, 1);
+        if (users[i].username == NULL)
+        {
+            rc = SQLITE_NOMEM;
+            break;
+        }
         rc = sqlite3_step(stmt);
         i++;
     }
 
     if (rc != SQLITE_DONE)
     {
-        printf("[Error][Database] GET usernames query execute error: %s\n", err);
+        printf("[Error][Database] GET users query execute error: %s\n", sqlite3_errmsg(connection->db));
         fflush(stdout);
-        return -1;
+        i = -1;
     }
 
-    sqlite3_clear_bindings(stmt);
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
+    ReleaseStatement(connection, stmt);
     return i;
 }
 
-int GetMessagesCountBetweenUsers(sqlite3 *db, const char *loggedUsername, const char *selectedUsername)
+int GetUsersWhereNotEqualUser(DatabaseConnection *connection, Arena *arena, UserViewStructure *users, const int userId, const int page)
 {
-    sqlite3_stmt *stmt;
-    char *err;
+    const int PAGE_SIZE = 10;
+    int offset = (page - 1) * PAGE_SIZE;
 
-    int rc = sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM messages WHERE (receiver = ? AND sender = ?) OR (receiver = ? AND sender = ?)", -1, &stmt, NULL);
-    if (rc != SQLITE_OK)
+    sqlite3_stmt *stmt = AcquireStatement(connection, STATEMENT_USERNAMES_PAGE);
+    sqlite3_bind_int(stmt, 1, userId);
+    sqlite3_bind_int(stmt, 2, PAGE_SIZE);
+    sqlite3_bind_int(stmt, 3, offset);
+    return ReadUsers(connection, stmt, arena, users);
+}
+
+// Keyset page: the users sorting after afterUsername with their unread counts, an empty afterUsername for the first page.
+int GetUsersAfterUsername(DatabaseConnection *connection, Arena *arena, UserViewStructure *users, const int userId, const char *afterUsername)
+{
+    const int PAGE_SIZE = 10;
+
+    sqlite3_stmt *stmt = AcquireStatement(connection, STATEMENT_USERNAMES_AFTER);
+    sqlite3_bind_text(stmt, 1, afterUsername, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, userId);
+    sqlite3_bind_int(stmt, 3, PAGE_SIZE);
+    return ReadUsers(connection, stmt, arena, users);
+}
+
+int GetMessagesCountBetweenUsers(DatabaseConnection *connection, const int loggedUserId, const int selectedUserId)
+{
+    sqlite3_stmt *stmt = AcquireStatement(connection, STATEMENT_MESSAGES_COUNT_BETWEEN_USERS);
+    sqlite3_bind_int(stmt, 1, loggedUserId);
+    sqlite3_bind_int(stmt, 2, selectedUserId);
+    return StepCount(connection, stmt, "Messages count between users query execute error");
+}
+
+// Steps a messages query into messages, the caller holding the connection mutex. The texts are allocated in arena.
+// Returns the rows count or -1. Only the sender ids are read, the caller names the senders.
+static int StepMessages(DatabaseConnection *connection, sqlite3_stmt *stmt, Arena *arena, MessageStructure *messages)
+{
+    int i = 0;
+    int rc = sqlite3_step(stmt);
+    while (rc == SQLITE_ROW)
     {
-        printf("[Error][Database] Messages count between users query prepare error: %s\n", err);
-        fflush(stdout);
-        return -1;
+        messages[i].id = sqlite3_column_int(stmt, 0);
+        messages[i].senderId = sqlite3_column_int(stmt, 1);
+        messages[i].sender = NULL;
+        messages[i].message = ArenaStrdup(arena, (const char *)sqlite3_column_text(stmt, 3));
+        messages[i].read = sqlite3_column_int(stmt, 4);
+        messages[i].replyId = sqlite3_column_int(stmt, 5);
+        if (messages[i].message == NULL)
+        {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+
+        rc = sqlite3_step(stmt);
+        i++;
     }
 
-    rc = sqlite3_bind_text(stmt, 1, loggedUsername, -1, SQLITE_STATIC);
-    rc = sqlite3_bind_text(stmt, 2, selectedUsername, -1, SQLITE_STATIC);
-    rc = sqlite3_bind_text(stmt, 3, selectedUsername, -1, SQLITE_STATIC);
-    rc = sqlite3_bind_text(stmt, 4, loggedUsername, -1, SQLITE_STATIC);
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW)
+    if (rc != SQLITE_DONE)
     {
-        printf("[Error][Database] Messages count between users query execute error: %s\n", err);
+        printf("[Error][Database] GET messages query execute error: %s\n", sqlite3_errmsg(connection->db));
         fflush(stdout);
-        return -1;
+        i = -1;
     }
 
-    int messagesCount = sqlite3_column_int(stmt, 0);
+    return i;
+}
 
-    sqlite3_clear_bindings(stmt);
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
+// Steps a messages query into messages, releasing the statement.
+static int ReadMessages(DatabaseConnection *connection, sqlite3_stmt *stmt, Arena *arena, MessageStructure *messages)
+{
+    int count = StepMessages(connection, stmt, arena, messages);
+    ReleaseStatement(connection, stmt);
+    return count;
+}
 
-    return messagesCount;
+int GetMessagesBetweenUsers(DatabaseConnection *connection, Arena *arena, MessageStructure *messages, const int loggedUserId, const int selectedUserId, const int page)
+{
+    const int PAGE_SIZE = 10;
+    int offset = (page - 1) * PAGE_SIZE;
+
+    sqlite3_stmt *stmt = AcquireStatement(connection, STATEMENT_MESSAGES_BETWEEN_USERS);
+    sqlite3_bind_int(stmt, 1, loggedUserId);
+    sqlite3_bind_int(stmt, 2, selectedUserId);
+    sqlite3_bind_int(stmt, 3, PAGE_SIZE);
+    sqlite3_bind_int(stmt, 4, offset);
+    return ReadMessages(connection, stmt, arena, messages);
 }
 
-int GetMessagesBetweenUsers(sqlite3 *db, char **messages, const char *loggedUsername, const char *selectedUsername, const int page)
+// Keyset page: the newest messages with an id lower than beforeId, beforeId <= 0 for the newest page.
+int GetMessagesBetweenUsersBefore(DatabaseConnection *connection, Arena *arena, MessageStructure *messages, const int loggedUserId, const int selectedUserId, const int beforeId)
 {
-    sqlite3_stmt *stmt;
-    char *err;
+    const int PAGE_SIZE = 10;
 
+    sqlite3_stmt *stmt = AcquireStatement(connection, STATEMENT_MESSAGES_BEFORE);
+    sqlite3_bind_int(stmt, 1, loggedUserId);
+    sqlite3_bind_int(stmt, 2, selectedUserId);
+    sqlite3_bind_int(stmt, 3, beforeId > 0 ? beforeId : INT_MAX);
+    sqlite3_bind_int(stmt, 4, PAGE_SIZE);
+    return ReadMessages(connection, stmt, arena, messages);
+}
+
+// The newest messages with an id greater than afterId, newest first, with the messages count and the read watermarks of both users.
+// A full page means older new messages may be left out. Both queries run in one read transaction, so they see the same snapshot.
+// Returns the rows count or -1.
+int SyncConversation(DatabaseConnection *connection, Arena *arena, MessageStructure *messages, SyncState *state, const int loggedUserId, const int selectedUserId, const int afterId)
+{
     const int PAGE_SIZE = 10;
-    int offset = (page - 1) * PAGE_SIZE;
+    char *err;
 
-    int rc = sqlite3_prepare_v2(db, "SELECT * FROM messages WHERE (receiver = ? AND sender = ?) OR (receiver = ? AND sender = ?) ORDER BY id DESC LIMIT ? OFFSET ?", -1, &stmt, NULL);
+    sqlite3_stmt *stmt = AcquireStatement(connection, STATEMENT_MESSAGES_AFTER);
+    // Guarded by the connection mutex taken above
+    sqlite3_stmt *stateStmt = connection->statements[STATEMENT_SYNC_STATE];
+
+    int rc = sqlite3_exec(connection->db, "BEGIN;", NULL, NULL, &err);
     if (rc != SQLITE_OK)
     {
-        printf("[Error][Database] GET messages between users query prepare error: %s\n", err);
+        printf("[Error][Database] Begin sync read error: %s\n", err);
         fflush(stdout);
+        sqlite3_free(err);
+        ReleaseStatement(connection, stmt);
         return -1;
     }
 
-    rc = sqlite3_bind_text(stmt, 1, loggedUsername, -1, SQLITE_STATIC);
-    rc = sqlite3_bind_text(stmt, 2, selectedUsername, -1, SQLITE_STATIC);
-    rc = sqlite3_bind_text(stmt, 3, selectedUsername, -1, SQLITE_STATIC);
-    rc = sqlite3_bind_text(stmt, 4, loggedUsername, -1, SQLITE_STATIC);
-    rc = sqlite3_bind_int(stmt, 5, PAGE_SIZE);
-    rc = sqlite3_bind_int(stmt, 6, offset);
+    sqlite3_bind_int(stmt, 1, loggedUserId);
+    sqlite3_bind_int(stmt, 2, selectedUserId);
+    sqlite3_bind_int(stmt, 3, afterId);
+    sqlite3_bind_int(stmt, 4, PAGE_SIZE);
+    int count = StepMessages(connection, stmt, arena, messages);
+    sqlite3_reset(stmt);
 
-    int i = 0;
-    rc = sqlite3_step(stmt);
-    while (rc == SQLITE_ROW)
+    if (count != -1)
     {
-        int id = sqlite3_column_int(stmt, 0);
-        char *sender = (char *)sqlite3_column_text(stmt, 1);
-        char *message = (char *)sqlite3_column_text(stmt, 3);
-        int read = sqlite3_column_int(stmt, 4);
-        int replyId = sqlite3_column_int(stmt, 5);
-
-        int len = snprintf(NULL, 0, "%d|%s|%s|%d|%d", id, sender, message, read, replyId);
-        if (len < 0)
+        sqlite3_bind_int(stateStmt, 1, loggedUserId);
+        sqlite3_bind_int(stateStmt, 2, selectedUserId);
+        if (sqlite3_step(stateStmt) != SQLITE_ROW)
         {
-            printf("[Error][Database] GET messages parsing error: %s\n", err);
+            printf("[Error][Database] Sync state query execute error: %s\n", sqlite3_errmsg(connection->db));
             fflush(stdout);
-            return -1;
+            count = -1;
+        }
+        else
+        {
+            state->messagesCount = sqlite3_column_int(stateStmt, 0);
+            state->readWatermark = sqlite3_column_int(stateStmt, 1);
+            state->peerReadWatermark = sqlite3_column_int(stateStmt, 2);
         }
+        sqlite3_reset(stateStmt);
+        sqlite3_clear_bindings(stateStmt);
+    }
 
-        messages[i] = (char *)malloc(len + 1);
-        snprintf(messages[i], len + 1, "%d|%s|%s|%d|%d", id, sender, message, read, replyId);
-        messages[i][strlen(messages[i])] = '\0';
+    // Nothing was written, ending the transaction only releases the snapshot
+    sqlite3_exec(connection->db, "COMMIT;", NULL, NULL, NULL);
 
-        rc = sqlite3_step(stmt);
-        i++;
-    }
+    ReleaseStatement(connection, stmt);
+    return count;
+}
 
-    if (rc != SQLITE_DONE)
+// Returns the new user id, USER_EXISTS when the username is taken or -1 on errors.
+int InsertUser(DatabaseConnection *connection, const char *username, const char *firstName, const char *lastName, const char *password)
+{
+    sqlite3_stmt *stmt = AcquireStatement(connection, STATEMENT_INSERT_USER);
+    sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, firstName, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, lastName, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, password, -1, SQLITE_STATIC);
+
+    int id = -1;
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE)
+    {
+        id = (int)sqlite3_last_insert_rowid(connection->db);
+    }
+    else if (rc == SQLITE_CONSTRAINT)
     {
-        printf("[Error][Database] GET messages query execute error: %s\n", err);
+        id = USER_EXISTS;
+    }
+    else
+    {
+        printf("[Error][Database] User insert query exec error: %s\n", sqlite3_errmsg(connection->db));
         fflush(stdout);
-        return -1;
     }
 
-    sqlite3_clear_bindings(stmt);
-    sqlite3_reset(stmt);
-    sqlite3_finalize(stmt);
-    return i;
+    ReleaseStatement(connection, stmt);
+    return id;
 }
 
-int GetUnreadMessagesCountBetweenUsers(sqlite3 *db, const char *loggedUsername, const char *selectedUsername)
+// Fills the directory with every user, 0 on success.
+int LoadUserDirectory(DatabaseConnection *connection, UserDirectory *directory)
 {
     sqlite3_stmt *stmt;
-    char *err;
-
-    int rc = sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM messages WHERE (receiver = ? AND sender = ?) AND read = 0", -1, &stmt, NULL);
+    int rc = sqlite3_prepare_v2(connection->db, "SELECT id, username, password FROM users", -1, &stmt, NULL);
     if (rc != SQLITE_OK)
     {
-        printf("[Error][Database] GET Unread Messages count between users query prepare error: %s\n", err);
+        printf("[Error][Database] Load users prepare error: %s\n", sqlite3_errmsg(connection->db));
         fflush(stdout);
         return -1;
     }
 
-    rc = sqlite3_bind_text(stmt, 1, loggedUsername, -1, SQLITE_STATIC);
-    rc = sqlite3_bind_text(stmt, 2, selectedUsername, -1, SQLITE_STATIC);
-
     rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW)
+    while (rc == SQLITE_ROW)
     {
-        printf("[Error][Database] GET Unread Messages count between users query execute error: %s\n", err);
-        fflush(stdout);
-        return -1;
+        if (AddUser(directory, sqlite3_column_int(stmt, 0), (const char *)sqlite3_column_text(stmt, 1),
+                    (const char *)sqlite3_column_text(stmt, 2)) != 0)
+        {
+            break;
+        }
+        rc = sqlite3_step(stmt);
     }
 
-    int messagesCount = sqlite3_column_int(stmt, 0);
+    if (rc != SQLITE_DONE)
+    {
+        printf("[Error][Database] Load users query execute error: %s\n", sqlite3_errmsg(connection->db));
+        fflush(stdout);
+    }
 
-    sqlite3_clear_bindings(stmt);
-    sqlite3_reset(stmt);
     sqlite3_finalize(stmt);
-
-    return messagesCount;
+    return rc == SQLITE_DONE ? 0 : -1;
 }
 
-int InsertUser(sqlite3 *db, const char *username, const char *firstName, const char *lastName, const char *password)
+// Inserts the whole batch and bumps the receivers' unread counts in one transaction, so it costs a single commit.
+// Sets each message result, all of them -1 when the batch is rolled back.
+int InsertMessagesBatch(DatabaseConnection *connection, QueuedMessage *messages, int count)
 {
     char *err;
+    sqlite3_stmt *stmt = AcquireStatement(connection, STATEMENT_INSERT_MESSAGE);
+    // Guarded by the connection mutex taken above
+    sqlite3_stmt *unreadStmt = connection->statements[STATEMENT_INCREMENT_UNREAD];
 
-    sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+    int rc = sqlite3_exec(connection->db, "BEGIN IMMEDIATE;", NULL, NULL, &err);
+    if (rc != SQLITE_OK)
+    {
+        printf("[Error][Database] Begin messages batch error: %s\n", err);
+        fflush(stdout);
+        sqlite3_free(err);
+    }
+
+    for (int i = 0; i < count && rc == SQLITE_OK; i++)
+    {
+        sqlite3_bind_int(stmt, 1, messages[i].senderId);
+        sqlite3_bind_int(stmt, 2, messages[i].receiverId);
+        sqlite3_bind_text(stmt, 3, messages[i].message, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 4, messages[i].replyId);
+        sqlite3_bind_int(unreadStmt, 1, messages[i].receiverId);
+        sqlite3_bind_int(unreadStmt, 2, messages[i].senderId);
+        if (sqlite3_step(stmt) != SQLITE_DONE || sqlite3_step(unreadStmt) != SQLITE_DONE)
+        {
+            printf("[Error][Database] Message insert query exec error: %s\n", sqlite3_errmsg(connection->db));
+            fflush(stdout);
+            rc = SQLITE_ERROR;
+        }
+        sqlite3_reset(stmt);
+        sqlite3_reset(unreadStmt);
+    }
 
-    char *query = sqlite3_mprintf("INSERT INTO users VALUES('%q','%q','%q','%q');", username, firstName, lastName, password);
-    printf("[Database] Query: %s\n", query);
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_exec(connection->db, "COMMIT;", NULL, NULL, &err);
+        if (rc != SQLITE_OK)
+        {
+            printf("[Error][Database] Commit messages batch error: %s\n", err);
+            fflush(stdout);
+            sqlite3_free(err);
+        }
+    }
 
-    int rc = sqlite3_exec(db, query, NULL, NULL, &err);
     if (rc != SQLITE_OK)
     {
-        printf("[Error][Database] User insert query exec error: %s\n", err);
-        fflush(stdout);
+        sqlite3_exec(connection->db, "ROLLBACK;", NULL, NULL, NULL);
+    }
 
-        sqlite3_exec(db, "END TRANSACTION;", NULL, NULL, NULL);
-        return -1;
+    for (int i = 0; i < count; i++)
+    {
+        messages[i].result = rc == SQLITE_OK ? 0 : -1;
     }
 
-    sqlite3_exec(db, "END TRANSACTION;", NULL, NULL, NULL);
-    return 0;
+    sqlite3_clear_bindings(unreadStmt);
+    ReleaseStatement(connection, stmt);
+    return rc == SQLITE_OK ? 0 : -1;
 }
 
-int InsertMessage(sqlite3 *db, const char *loggedUsername, const char *selectedUser, const char *message, int replyId)
+// Moves reader's watermarks up to the given messages in one transaction, returns the number of watermarks moved or -1 on errors.
+// Messages reader didn't receive are skipped.
+int UpdateMessagesRead(DatabaseConnection *connection, const int readerId, const int *messageIds, int count)
 {
     char *err;
+    int changed = 0;
+    sqlite3_stmt *stmt = AcquireStatement(connection, STATEMENT_UPDATE_MESSAGE_READ);
 
-    sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
-
-    char *query = sqlite3_mprintf("INSERT INTO messages(sender, receiver, message, read, replyId)  VALUES('%q','%q','%q', %d, %d);", loggedUsername, selectedUser, message, 0, replyId);
-    printf("[Database] Query: %s\n", query);
-
-    int rc = sqlite3_exec(db, query, NULL, NULL, &err);
+    int rc = sqlite3_exec(connection->db, "BEGIN IMMEDIATE;", NULL, NULL, &err);
     if (rc != SQLITE_OK)
     {
-        printf("[Error][Database] Message insert query exec error: %s\n", err);
+        printf("[Error][Database] Begin messages update error: %s\n", err);
         fflush(stdout);
-
-        sqlite3_exec(db, "END TRANSACTION;", NULL, NULL, NULL);
+        sqlite3_free(err);
+        ReleaseStatement(connection, stmt);
         return -1;
     }
 
-    sqlite3_exec(db, "END TRANSACTION;", NULL, NULL, NULL);
-    return 0;
-}
+    sqlite3_bind_int(stmt, 1, readerId);
+    for (int i = 0; i < count && rc == SQLITE_OK; i++)
+    {
+        sqlite3_bind_int(stmt, 2, messageIds[i]);
+        if (sqlite3_step(stmt) != SQLITE_DONE)
+        {
+            printf("[Error][Database] Message update query exec error: %s\n", sqlite3_errmsg(connection->db));
+            fflush(stdout);
+            rc = SQLITE_ERROR;
+        }
+        else
+        {
+            changed += sqlite3_changes(connection->db);
+        }
+        sqlite3_reset(stmt);
+    }
 
-int UpdateMessage(sqlite3 *db, const int messageId)
-{
-    char *err;
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_exec(connection->db, "COMMIT;", NULL, NULL, &err);
+        if (rc != SQLITE_OK)
+        {
+            printf("[Error][Database] Commit messages update error: %s\n", err);
+            fflush(stdout);
+            sqlite3_free(err);
+        }
+    }
 
-    sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK)
+    {
+        sqlite3_exec(connection->db, "ROLLBACK;", NULL, NULL, NULL);
+    }
 
-    char *query = sqlite3_mprintf("UPDATE messages SET read = 1 WHERE id = %d;", messageId);
+    ReleaseStatement(connection, stmt);
+    return rc == SQLITE_OK ? changed : -1;
+}
 
-    int rc = sqlite3_exec(db, query, NULL, NULL, &err);
-    if (rc != SQLITE_OK)
+// Marks the messages from peer up to lastReadId read for reader, returns 1 when the watermark moved, 0 when it was already there, -1 on errors.
+int MarkConversationRead(DatabaseConnection *connection, const int readerId, const int peerId, const int lastReadId)
+{
+    sqlite3_stmt *stmt = AcquireStatement(connection, STATEMENT_MARK_CONVERSATION_READ);
+    sqlite3_bind_int(stmt, 1, readerId);
+    sqlite3_bind_int(stmt, 2, peerId);
+    sqlite3_bind_int(stmt, 3, lastReadId);
+
+    int rc = sqlite3_step(stmt);
+    int changed = sqlite3_changes(connection->db);
+    if (rc != SQLITE_DONE)
     {
-        printf("[Error][Database] Message update query exec error: %s\n", err);
+        printf("[Error][Database] Conversation read query exec error: %s\n", sqlite3_errmsg(connection->db));
         fflush(stdout);
-
-        sqlite3_exec(db, "END TRANSACTION;", NULL, NULL, NULL);
-        return -1;
     }
 
-    sqlite3_exec(db, "END TRANSACTION;", NULL, NULL, NULL);
-    return 0;
-}
\ No newline at end of file
+    ReleaseStatement(connection, stmt);
+    return rc == SQLITE_DONE ? changed : -1;
+}
@@ -2,21 +2,75 @@
 #define DATABASE_UTILS_H
 
 #include "../sql/sqlite3.h"
+#include "communication_types.h"
+#include "user_directory_utils.h"
+#include "arena_utils.h"
 
+#include <pthread.h>
+
+#define STATEMENT_USERNAMES_PAGE 0
+#define STATEMENT_MESSAGES_COUNT_BETWEEN_USERS 1
+#define STATEMENT_MESSAGES_BETWEEN_USERS 2
+#define STATEMENT_INSERT_USER 3
+#define STATEMENT_INSERT_MESSAGE 4
+#define STATEMENT_UPDATE_MESSAGE_READ 5
+#define STATEMENT_USERNAMES_AFTER 6
+#define STATEMENT_MESSAGES_BEFORE 7
+#define STATEMENT_MARK_CONVERSATION_READ 8
+#define STATEMENT_INCREMENT_UNREAD 9
+#define STATEMENT_MESSAGES_AFTER 10
+#define STATEMENT_SYNC_STATE 11
+#define STATEMENTS_COUNT 12
+
+// InsertUser result when the username is already taken
+#define USER_EXISTS -2
+
+typedef struct DatabaseConnection
+{
+    sqlite3 *db;
+    sqlite3_stmt *statements[STATEMENTS_COUNT];
+    pthread_mutex_t mutex;
+} DatabaseConnection;
+
+typedef struct DatabasePool
+{
+    DatabaseConnection *writer;
+    DatabaseConnection **readers;
+    int readersCount;
+    int nextReader;
+} DatabasePool;
+
+typedef struct QueuedMessage
+{
+    int senderId;
+    int receiverId;
+    const char *message;
+    int replyId;
+    int result;
+} QueuedMessage;
+
+int MigrateDatabase(sqlite3 *db);
 int CreateDatabase(sqlite3 **db, const char *databaseName);
 int OpenDatabase(sqlite3 **db, const char *databaseName);
+int OpenReadOnlyDatabase(sqlite3 **db, const char *databaseName);
+DatabaseConnection *CreateDatabaseConnection(sqlite3 *db);
+void FreeDatabaseConnection(DatabaseConnection *connection);
+DatabasePool *CreateDatabasePool(sqlite3 *writer, const char *databaseName, int readersCount);
+void FreeDatabasePool(DatabasePool *pool);
+DatabaseConnection *ReaderConnection(DatabasePool *pool);
 
-int InsertUser(sqlite3 *db, const char *username, const char *firstName, const char *lastName, const char *password);
-int InsertMessage(sqlite3 *db, const char *loggedUsername, const char  *selectedUser, const char *message, int replyId);
+int InsertUser(DatabaseConnection *connection, const char *username, const char *firstName, const char *lastName, const char *password);
+int InsertMessagesBatch(DatabaseConnection *connection, QueuedMessage *messages, int count);
 
-int UpdateMessage(sqlite3 *db, const int messageId);
+int UpdateMessagesRead(DatabaseConnection *connection, const int readerId, const int *messageIds, int count);
+int MarkConversationRead(DatabaseConnection *connection, const int readerId, const int peerId, const int lastReadId);
 
-int GetUsersCount(sqlite3 *db);
-int GetUsersCountByUsername(sqlite3 *db, const char *username);
-int GetUsersCountByUsernameAndPassword(sqlite3 *db, const char *username, const char *password);
-int GetUsernamesWhereNotEqualUsername(sqlite3 *db, char **usernames, const char *username, const int page);
+int GetUsersWhereNotEqualUser(DatabaseConnection *connection, Arena *arena, UserViewStructure *users, const int userId, const int page);
+int GetUsersAfterUsername(DatabaseConnection *connection, Arena *arena, UserViewStructure *users, const int userId, const char *afterUsername);
+int LoadUserDirectory(DatabaseConnection *connection, UserDirectory *directory);
 
-int GetMessagesCountBetweenUsers(sqlite3 *db, const char *loggedUsername, const char *selectedUsername);
-int GetUnreadMessagesCountBetweenUsers(sqlite3 *db, const char *loggedUsername, const char *selectedUsername);
-int GetMessagesBetweenUsers(sqlite3 *db, char **messages, const char *loggedUsername, const char *selectedUsername, const int page);
+int GetMessagesCountBetweenUsers(DatabaseConnection *connection, const int loggedUserId, const int selectedUserId);
+int GetMessagesBetweenUsers(DatabaseConnection *connection, Arena *arena, MessageStructure *messages, const int loggedUserId, const int selectedUserId, const int page);
+int GetMessagesBetweenUsersBefore(DatabaseConnection *connection, Arena *arena, MessageStructure *messages, const int loggedUserId, const int selectedUserId, const int beforeId);
+int SyncConversation(DatabaseConnection *connection, Arena *arena, MessageStructure *messages, SyncState *state, const int loggedUserId, const int selectedUserId, const int afterId);
 #endif
\ No newline at end of file
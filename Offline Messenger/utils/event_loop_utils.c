@@ -0,0 +1,484 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "communication_utils.h"
+#include "connection_utils.h"
+#include "event_loop_utils.h"
+#include "buffer_pool_utils.h"
+
+#define MAX_EVENTS 256
+#define READ_CHUNK_SIZE 8192
+#define ACCEPT_RETRY_MILLISECONDS 100
+
+typedef struct EventLoop
+{
+    int index;
+    int epollDescriptor;
+    int listenSocket;
+    int acceptPaused;
+    struct timespec acceptResume;
+    pthread_t thread;
+    EventLoopCallbacks callbacks;
+
+    int wakeDescriptor;
+    pthread_mutex_t completedMutex;
+    Connection *completed;
+} EventLoop;
+
+static int SetNonBlocking(int socket)
+{
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags == -1)
+    {
+        return -1;
+    }
+
+    return fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int WatchConnection(EventLoop *loop, Connection *connection, unsigned int events)
+{
+    if (connection->watchedEvents == events)
+    {
+        return 0;
+    }
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = connection;
+
+    if (epoll_ctl(loop->epollDescriptor, EPOLL_CTL_MOD, connection->socket, &event) == -1)
+    {
+        printf("[Error][EventLoop %d] epoll_ctl() error: %s\n", loop->index, strerror(errno));
+        fflush(stdout);
+        return -1;
+    }
+
+    connection->watchedEvents = events;
+    return 0;
+}
+
+static int AddConnection(EventLoop *loop, Connection *connection)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = connection;
+
+    if (epoll_ctl(loop->epollDescriptor, EPOLL_CTL_ADD, connection->socket, &event) == -1)
+    {
+        printf("[Error][EventLoop %d] epoll_ctl() error: %s\n", loop->index, strerror(errno));
+        fflush(stdout);
+        return -1;
+    }
+
+    connection->watchedEvents = event.events;
+    return 0;
+}
+
+// Called from worker threads: hands the response back to the loop that owns the connection.
+static void CompleteRequest(Connection *connection, char *response, int responseLength)
+{
+    EventLoop *loop = (EventLoop *)connection->owner;
+
+    connection->output = response;
+    connection->outputLength = responseLength;
+    connection->outputOffset = 0;
+
+    pthread_mutex_lock(&loop->completedMutex);
+    connection->nextCompleted = loop->completed;
+    loop->completed = connection;
+    pthread_mutex_unlock(&loop->completedMutex);
+
+    uint64_t wake = 1;
+    if (write(loop->wakeDescriptor, &wake, sizeof(wake)) == -1 && errno != EAGAIN)
+    {
+        printf("[Error][EventLoop %d] Error at wake up: %s\n", loop->index, strerror(errno));
+        fflush(stdout);
+    }
+}
+
+static void CloseConnection(EventLoop *loop, Connection *connection)
+{
+    epoll_ctl(loop->epollDescriptor, EPOLL_CTL_DEL, connection->socket, NULL);
+
+    loop->callbacks.onDisconnect(connection);
+    FreeConnection(connection);
+}
+
+// Hands the next buffered frame to the request callback, or goes back to reading when none is complete.
+// Only one request per connection is in flight; reading resumes once its response is sent.
+static int DispatchNextFrame(EventLoop *loop, Connection *connection)
+{
+    int frameLength;
+    char *frame = NextFrame(&connection->input, &frameLength);
+    if (frame == NULL)
+    {
+        if (frameLength == -1)
+        {
+            printf("[Error][EventLoop %d][Client %d] Frame too large.\n", loop->index, connection->clientId);
+            fflush(stdout);
+            return -1;
+        }
+
+        return WatchConnection(loop, connection, EPOLLIN | EPOLLRDHUP);
+    }
+
+    if (WatchConnection(loop, connection, 0) == -1)
+    {
+        return -1;
+    }
+
+    connection->busy = 1;
+    if (loop->callbacks.onRequest(connection, frame, frameLength) == -1)
+    {
+        connection->busy = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Writes as much of the pending response as the socket accepts, then moves on to the next buffered frame.
+static int FlushConnection(EventLoop *loop, Connection *connection)
+{
+    while (connection->outputOffset < connection->outputLength)
+    {
+        ssize_t noOfBytesSent = send(connection->socket, connection->output + connection->outputOffset,
+                                     connection->outputLength - connection->outputOffset, MSG_NOSIGNAL);
+        if (noOfBytesSent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return WatchConnection(loop, connection, EPOLLOUT);
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return -1;
+        }
+
+        connection->outputOffset += noOfBytesSent;
+    }
+
+    ReturnBuffer(connection->output);
+    connection->output = NULL;
+    connection->outputLength = 0;
+    connection->outputOffset = 0;
+
+    return DispatchNextFrame(loop, connection);
+}
+
+// Reads on the stack and buffers only what arrived, so a connection between requests holds no input buffer.
+static int ReadConnection(EventLoop *loop, Connection *connection)
+{
+    char chunk[READ_CHUNK_SIZE];
+    ssize_t noOfBytesRead = recv(connection->socket, chunk, sizeof(chunk), 0);
+    if (noOfBytesRead == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return 0;
+        }
+
+        printf("[Error][EventLoop %d][Client %d] Error at recv().\n", loop->index, connection->clientId);
+        fflush(stdout);
+        return -1;
+    }
+    else if (noOfBytesRead == 0)
+    {
+        return -1;
+    }
+
+    if (AppendToFrameBuffer(&connection->input, chunk, noOfBytesRead) != 0)
+    {
+        return -1;
+    }
+
+    return DispatchNextFrame(loop, connection);
+}
+
+static void ProcessCompletedRequests(EventLoop *loop)
+{
+    uint64_t wakeCount;
+    if (read(loop->wakeDescriptor, &wakeCount, sizeof(wakeCount)) == -1 && errno != EAGAIN)
+    {
+        printf("[Error][EventLoop %d] Error at read wake ups: %s\n", loop->index, strerror(errno));
+        fflush(stdout);
+    }
+
+    pthread_mutex_lock(&loop->completedMutex);
+    Connection *connection = loop->completed;
+    loop->completed = NULL;
+    pthread_mutex_unlock(&loop->completedMutex);
+
+    while (connection != NULL)
+    {
+        Connection *next = connection->nextCompleted;
+        connection->nextCompleted = NULL;
+        connection->busy = 0;
+        ConsumeFrame(&connection->input);
+
+        if (connection->closing || connection->output == NULL || FlushConnection(loop, connection) == -1)
+        {
+            CloseConnection(loop, connection);
+        }
+
+        connection = next;
+    }
+}
+
+static int WatchListener(EventLoop *loop)
+{
+    // When loops share a listener, EPOLLEXCLUSIVE wakes only one of them per connection.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    return epoll_ctl(loop->epollDescriptor, EPOLL_CTL_ADD, loop->listenSocket, &event);
+}
+
+// Out of descriptors or memory the connection stays queued and the level-triggered listener would wake the loop
+// again at once, so the listener is unwatched until the retry.
+static void PauseAccept(EventLoop *loop, int error)
+{
+    printf("[Error][EventLoop %d] Error at accept(): %s, retrying in %d ms\n", loop->index, strerror(error), ACCEPT_RETRY_MILLISECONDS);
+    fflush(stdout);
+
+    epoll_ctl(loop->epollDescriptor, EPOLL_CTL_DEL, loop->listenSocket, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &loop->acceptResume);
+    loop->acceptResume.tv_nsec += ACCEPT_RETRY_MILLISECONDS * 1000000L;
+    if (loop->acceptResume.tv_nsec >= 1000000000L)
+    {
+        loop->acceptResume.tv_sec++;
+        loop->acceptResume.tv_nsec -= 1000000000L;
+    }
+    loop->acceptPaused = 1;
+}
+
+// The epoll_wait() timeout: milliseconds until the accept retry, -1 while accepting.
+static int AcceptTimeout(EventLoop *loop)
+{
+    if (!loop->acceptPaused)
+    {
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long remaining = (loop->acceptResume.tv_sec - now.tv_sec) * 1000000000LL + (loop->acceptResume.tv_nsec - now.tv_nsec);
+    return remaining > 0 ? (int)((remaining + 999999) / 1000000) : 0;
+}
+
+static void AcceptConnections(EventLoop *loop)
+{
+    while (1)
+    {
+        int client = accept4(loop->listenSocket, NULL, NULL, SOCK_NONBLOCK);
+        if (client == -1)
+        {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                PauseAccept(loop, errno);
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                printf("[Error][EventLoop %d] Error at accept(): %s\n", loop->index, strerror(errno));
+                fflush(stdout);
+            }
+            return;
+        }
+
+        Connection *connection = CreateConnection(client);
+        if (connection == NULL)
+        {
+            close(client);
+            continue;
+        }
+        connection->owner = loop;
+        connection->complete = &CompleteRequest;
+
+        if (AddConnection(loop, connection) == -1)
+        {
+            FreeConnection(connection);
+            continue;
+        }
+
+        loop->callbacks.onConnect(connection);
+    }
+}
+
+static void ResumeAccept(EventLoop *loop)
+{
+    if (!loop->acceptPaused || AcceptTimeout(loop) > 0)
+    {
+        return;
+    }
+
+    if (WatchListener(loop) == -1)
+    {
+        PauseAccept(loop, errno);
+        return;
+    }
+
+    loop->acceptPaused = 0;
+    AcceptConnections(loop);
+}
+
+static void *RunEventLoop(void *arg)
+{
+    EventLoop *loop = (EventLoop *)arg;
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1)
+    {
+        int eventsCount = epoll_wait(loop->epollDescriptor, events, MAX_EVENTS, AcceptTimeout(loop));
+        ResumeAccept(loop);
+        if (eventsCount == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            printf("[Error][EventLoop %d] epoll_wait() error: %s\n", loop->index, strerror(errno));
+            fflush(stdout);
+            break;
+        }
+
+        for (int i = 0; i < eventsCount; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                AcceptConnections(loop);
+                continue;
+            }
+
+            if (events[i].data.ptr == loop)
+            {
+                ProcessCompletedRequests(loop);
+                continue;
+            }
+
+            Connection *connection = (Connection *)events[i].data.ptr;
+            int result = 0;
+
+            // A busy connection is still referenced by a worker, so it is only released once its request completes.
+            if (connection->busy)
+            {
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                {
+                    connection->closing = 1;
+                    epoll_ctl(loop->epollDescriptor, EPOLL_CTL_DEL, connection->socket, NULL);
+                }
+                continue;
+            }
+
+            if (events[i].events & EPOLLERR)
+            {
+                result = -1;
+            }
+            else if (events[i].events & EPOLLOUT)
+            {
+                result = FlushConnection(loop, connection);
+            }
+            else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))
+            {
+                result = ReadConnection(loop, connection);
+            }
+
+            if (result == -1)
+            {
+                CloseConnection(loop, connection);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Loop i accepts from listenSockets[i]. The entries may all be the same socket or one SO_REUSEPORT listener per loop.
+int RunEventLoops(int *listenSockets, int loopsCount, EventLoopCallbacks callbacks)
+{
+    if (loopsCount <= 0)
+    {
+        return -1;
+    }
+
+    EventLoop *loops = (EventLoop *)calloc(loopsCount, sizeof(EventLoop));
+    if (loops == NULL)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < loopsCount; i++)
+    {
+        loops[i].index = i;
+        loops[i].listenSocket = listenSockets[i];
+        loops[i].callbacks = callbacks;
+
+        if (SetNonBlocking(listenSockets[i]) == -1)
+        {
+            printf("[Error][EventLoop %d] Error at set listen socket non-blocking!\n", i);
+            return -1;
+        }
+
+        loops[i].epollDescriptor = epoll_create1(0);
+        if (loops[i].epollDescriptor == -1)
+        {
+            printf("[Error][EventLoop %d] epoll_create1() error: %s\n", i, strerror(errno));
+            return -1;
+        }
+
+        loops[i].wakeDescriptor = eventfd(0, EFD_NONBLOCK);
+        if (loops[i].wakeDescriptor == -1)
+        {
+            printf("[Error][EventLoop %d] eventfd() error: %s\n", i, strerror(errno));
+            return -1;
+        }
+        pthread_mutex_init(&loops[i].completedMutex, NULL);
+        loops[i].completed = NULL;
+
+        struct epoll_event wakeEvent;
+        wakeEvent.events = EPOLLIN;
+        wakeEvent.data.ptr = &loops[i];
+        if (epoll_ctl(loops[i].epollDescriptor, EPOLL_CTL_ADD, loops[i].wakeDescriptor, &wakeEvent) == -1)
+        {
+            printf("[Error][EventLoop %d] Error at watch wake up descriptor: %s\n", i, strerror(errno));
+            return -1;
+        }
+
+        if (WatchListener(&loops[i]) == -1)
+        {
+            printf("[Error][EventLoop %d] Error at watch listen socket: %s\n", i, strerror(errno));
+            return -1;
+        }
+    }
+
+    for (int i = 1; i < loopsCount; i++)
+    {
+        int threadCreationResult = pthread_create(&loops[i].thread, NULL, &RunEventLoop, &loops[i]);
+        if (threadCreationResult != 0)
+        {
+            printf("[Error][EventLoop %d] Failed to create thread: %s\n", i, strerror(threadCreationResult));
+            return -1;
+        }
+    }
+
+    RunEventLoop(&loops[0]);
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef EVENT_LOOP_UTILS_H
+#define EVENT_LOOP_UTILS_H
+
+#include "connection_utils.h"
+
+typedef struct EventLoopCallbacks
+{
+    void (*onConnect)(Connection *connection);
+    int (*onRequest)(Connection *connection, char *request, int requestLength);
+    void (*onDisconnect)(Connection *connection);
+} EventLoopCallbacks;
+
+int RunEventLoops(int *listenSockets, int loopsCount, EventLoopCallbacks callbacks);
+
+#endif
@@ -0,0 +1,883 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "communication_utils.h"
+#include "connection_utils.h"
+#include "event_loop_utils.h"
+#include "io_uring_utils.h"
+#include "buffer_pool_utils.h"
+
+#define SUBMISSION_ENTRIES 256
+#define COMPLETION_ENTRIES 4096
+
+// Provided buffer ring: the kernel picks a free buffer for every multishot recv completion.
+#define BUFFERS_COUNT 256
+#define BUFFER_SIZE 8192
+#define BUFFER_GROUP 0
+
+// A connection stops receiving once this much is buffered while it isn't idle, and resumes when it is idle again.
+#define INPUT_PAUSE_SIZE (64 * 1024)
+
+// Accepting again right after running out of descriptors or memory fails the same way, so the loop waits first.
+#define ACCEPT_RETRY_NANOSECONDS (100 * 1000 * 1000)
+
+// The operation is stored in the low bits of the user data, next to the connection pointer.
+#define OPERATION_ACCEPT 1
+#define OPERATION_RECV 2
+#define OPERATION_SEND 3
+#define OPERATION_WAKE 4
+#define OPERATION_CANCEL 5
+#define OPERATION_ACCEPT_RETRY 6
+#define OPERATION_MASK 7ULL
+
+struct IoUringLoop
+{
+    int index;
+    int listenSocket;
+    struct __kernel_timespec acceptRetry;
+    pthread_t thread;
+    EventLoopCallbacks callbacks;
+
+    int ringDescriptor;
+    char *ring;
+    size_t ringSize;
+    size_t submissionsSize;
+    unsigned *submissionHead;
+    unsigned *submissionTail;
+    unsigned *submissionArray;
+    unsigned submissionMask;
+    unsigned submissionEntries;
+    unsigned pendingSubmissions;
+    struct io_uring_sqe *submissions;
+
+    unsigned *completionHead;
+    unsigned *completionTail;
+    unsigned completionMask;
+    struct io_uring_cqe *completions;
+
+    struct io_uring_buf_ring *bufferRing;
+    char *buffers;
+
+    int wakeDescriptor;
+    uint64_t wakeValue;
+    pthread_mutex_t completedMutex;
+    Connection *completed;
+};
+
+static int IoUringSetup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int IoUringEnter(int ringDescriptor, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ringDescriptor, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int IoUringRegister(int ringDescriptor, unsigned opcode, void *arg, unsigned argsCount)
+{
+    return syscall(__NR_io_uring_register, ringDescriptor, opcode, arg, argsCount);
+}
+
+static void ProvideBuffer(IoUringLoop *loop, unsigned short bufferId)
+{
+    unsigned short tail = loop->bufferRing->tail;
+    struct io_uring_buf *buffer = &loop->bufferRing->bufs[tail & (BUFFERS_COUNT - 1)];
+
+    buffer->addr = (uint64_t)(uintptr_t)(loop->buffers + (size_t)bufferId * BUFFER_SIZE);
+    buffer->len = BUFFER_SIZE;
+    buffer->bid = bufferId;
+
+    __atomic_store_n(&loop->bufferRing->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *GetSubmission(IoUringLoop *loop);
+
+// Checks the opcodes the loop submits against the kernel's probe.
+static int ProbeOperations(IoUringLoop *loop)
+{
+    const int operations[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ, IORING_OP_ASYNC_CANCEL,
+                              IORING_OP_TIMEOUT};
+    const int operationsCount = sizeof(operations) / sizeof(operations[0]);
+
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+    {
+        printf("[Error][IoUring %d] Error at allocate probe.\n", loop->index);
+        return -1;
+    }
+
+    if (IoUringRegister(loop->ringDescriptor, IORING_REGISTER_PROBE, probe, 256) != 0)
+    {
+        printf("[Error][IoUring %d] Probe not supported: %s\n", loop->index, strerror(errno));
+        free(probe);
+        return -1;
+    }
+
+    for (int i = 0; i < operationsCount; i++)
+    {
+        if (operations[i] > probe->last_op || !(probe->ops[operations[i]].flags & IO_URING_OP_SUPPORTED))
+        {
+            printf("[Error][IoUring %d] Operation %d not supported.\n", loop->index, operations[i]);
+            free(probe);
+            return -1;
+        }
+    }
+
+    free(probe);
+    return 0;
+}
+
+// Waits for the next completion and pops it.
+static int WaitCompletion(IoUringLoop *loop, struct io_uring_cqe *completion)
+{
+    while (*loop->completionHead == __atomic_load_n(loop->completionTail, __ATOMIC_ACQUIRE))
+    {
+        int submitted = IoUringEnter(loop->ringDescriptor, loop->pendingSubmissions, 1, IORING_ENTER_GETEVENTS);
+        if (submitted < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+        if (submitted > 0)
+        {
+            loop->pendingSubmissions -= submitted;
+        }
+    }
+
+    unsigned head = *loop->completionHead;
+    *completion = loop->completions[head & loop->completionMask];
+    __atomic_store_n(loop->completionHead, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Multishot recv needs a newer kernel than provided buffer rings (multishot accept came with them), and the probe
+// doesn't tell flags apart, so one multishot recv is armed on a socket pair: it has to deliver a byte and stay armed.
+static int CheckMultishotReceive(IoUringLoop *loop)
+{
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1)
+    {
+        printf("[Error][IoUring %d] socketpair() error: %s\n", loop->index, strerror(errno));
+        return -1;
+    }
+
+    struct io_uring_sqe *submission = GetSubmission(loop);
+    if (submission == NULL)
+    {
+        close(sockets[0]);
+        close(sockets[1]);
+        return -1;
+    }
+    submission->opcode = IORING_OP_RECV;
+    submission->fd = sockets[0];
+    submission->ioprio = IORING_RECV_MULTISHOT;
+    submission->flags = IOSQE_BUFFER_SELECT;
+    submission->buf_group = BUFFER_GROUP;
+
+    struct io_uring_cqe completion;
+    int supported = 0;
+    if (write(sockets[1], "", 1) == 1 && WaitCompletion(loop, &completion) == 0)
+    {
+        supported = completion.res == 1 && (completion.flags & IORING_CQE_F_MORE);
+        if (completion.flags & IORING_CQE_F_BUFFER)
+        {
+            ProvideBuffer(loop, completion.flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+
+        // Shutting the socket down ends the armed recv
+        if (completion.flags & IORING_CQE_F_MORE)
+        {
+            shutdown(sockets[0], SHUT_RDWR);
+            do
+            {
+                if (WaitCompletion(loop, &completion) != 0)
+                {
+                    supported = 0;
+                    break;
+                }
+                if (completion.flags & IORING_CQE_F_BUFFER)
+                {
+                    ProvideBuffer(loop, completion.flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+            } while (completion.flags & IORING_CQE_F_MORE);
+        }
+    }
+
+    close(sockets[0]);
+    close(sockets[1]);
+
+    if (!supported)
+    {
+        printf("[Error][IoUring %d] Multishot recv not supported.\n", loop->index);
+    }
+    return supported ? 0 : -1;
+}
+
+static int InitRing(IoUringLoop *loop)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = COMPLETION_ENTRIES;
+
+    loop->ringDescriptor = IoUringSetup(SUBMISSION_ENTRIES, &params);
+    if (loop->ringDescriptor < 0)
+    {
+        printf("[Error][IoUring %d] io_uring_setup() error: %s\n", loop->index, strerror(errno));
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        printf("[Error][IoUring %d] Kernel is too old (no single mmap ring).\n", loop->index);
+        return -1;
+    }
+
+    size_t submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ringSize = submissionRingSize > completionRingSize ? submissionRingSize : completionRingSize;
+
+    loop->ringSize = ringSize;
+    loop->ring = (char *)mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              loop->ringDescriptor, IORING_OFF_SQ_RING);
+    loop->submissionsSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->submissions = (struct io_uring_sqe *)mmap(NULL, loop->submissionsSize, PROT_READ | PROT_WRITE,
+                                                     MAP_SHARED | MAP_POPULATE, loop->ringDescriptor, IORING_OFF_SQES);
+    if (loop->ring == MAP_FAILED || loop->submissions == MAP_FAILED)
+    {
+        printf("[Error][IoUring %d] Error at map rings: %s\n", loop->index, strerror(errno));
+        return -1;
+    }
+    char *ring = loop->ring;
+
+    loop->submissionHead = (unsigned *)(ring + params.sq_off.head);
+    loop->submissionTail = (unsigned *)(ring + params.sq_off.tail);
+    loop->submissionArray = (unsigned *)(ring + params.sq_off.array);
+    loop->submissionMask = *(unsigned *)(ring + params.sq_off.ring_mask);
+    loop->submissionEntries = params.sq_entries;
+    loop->pendingSubmissions = 0;
+
+    loop->completionHead = (unsigned *)(ring + params.cq_off.head);
+    loop->completionTail = (unsigned *)(ring + params.cq_off.tail);
+    loop->completionMask = *(unsigned *)(ring + params.cq_off.ring_mask);
+    loop->completions = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    loop->bufferRing = (struct io_uring_buf_ring *)mmap(NULL, BUFFERS_COUNT * sizeof(struct io_uring_buf),
+                                                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    loop->buffers = (char *)malloc((size_t)BUFFERS_COUNT * BUFFER_SIZE);
+    if (loop->bufferRing == MAP_FAILED || loop->buffers == NULL)
+    {
+        printf("[Error][IoUring %d] Error at allocate provided buffers.\n", loop->index);
+        return -1;
+    }
+
+    struct io_uring_buf_reg bufferRegistration;
+    memset(&bufferRegistration, 0, sizeof(bufferRegistration));
+    bufferRegistration.ring_addr = (uint64_t)(uintptr_t)loop->bufferRing;
+    bufferRegistration.ring_entries = BUFFERS_COUNT;
+    bufferRegistration.bgid = BUFFER_GROUP;
+    if (IoUringRegister(loop->ringDescriptor, IORING_REGISTER_PBUF_RING, &bufferRegistration, 1) != 0)
+    {
+        printf("[Error][IoUring %d] Provided buffer rings not supported: %s\n", loop->index, strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < BUFFERS_COUNT; i++)
+    {
+        ProvideBuffer(loop, i);
+    }
+
+    return ProbeOperations(loop) == 0 && CheckMultishotReceive(loop) == 0 ? 0 : -1;
+}
+
+// Undoes InitRing and the wake up descriptor, for the loops set up before one failed.
+// Closing the ring descriptor also unregisters the provided buffer ring.
+static void FreeIoUringLoop(IoUringLoop *loop)
+{
+    if (loop->ring != MAP_FAILED)
+    {
+        munmap(loop->ring, loop->ringSize);
+    }
+    if (loop->submissions != MAP_FAILED)
+    {
+        munmap(loop->submissions, loop->submissionsSize);
+    }
+    if (loop->ringDescriptor >= 0)
+    {
+        close(loop->ringDescriptor);
+    }
+    if (loop->bufferRing != MAP_FAILED)
+    {
+        munmap(loop->bufferRing, BUFFERS_COUNT * sizeof(struct io_uring_buf));
+    }
+    free(loop->buffers);
+    if (loop->wakeDescriptor >= 0)
+    {
+        close(loop->wakeDescriptor);
+    }
+    pthread_mutex_destroy(&loop->completedMutex);
+}
+
+static void SubmitPending(IoUringLoop *loop)
+{
+    if (loop->pendingSubmissions == 0)
+    {
+        return;
+    }
+
+    int submitted = IoUringEnter(loop->ringDescriptor, loop->pendingSubmissions, 0, 0);
+    if (submitted > 0)
+    {
+        loop->pendingSubmissions -= submitted;
+    }
+}
+
+static struct io_uring_sqe *GetSubmission(IoUringLoop *loop)
+{
+    unsigned tail = *loop->submissionTail;
+    if (tail - __atomic_load_n(loop->submissionHead, __ATOMIC_ACQUIRE) >= loop->submissionEntries)
+    {
+        SubmitPending(loop);
+        if (tail - __atomic_load_n(loop->submissionHead, __ATOMIC_ACQUIRE) >= loop->submissionEntries)
+        {
+            printf("[Error][IoUring %d] Submission queue full.\n", loop->index);
+            fflush(stdout);
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & loop->submissionMask;
+    struct io_uring_sqe *submission = &loop->submissions[index];
+    memset(submission, 0, sizeof(*submission));
+    loop->submissionArray[index] = index;
+
+    __atomic_store_n(loop->submissionTail, tail + 1, __ATOMIC_RELEASE);
+    loop->pendingSubmissions++;
+
+    return submission;
+}
+
+static int ArmAccept(IoUringLoop *loop)
+{
+    struct io_uring_sqe *submission = GetSubmission(loop);
+    if (submission == NULL)
+    {
+        return -1;
+    }
+
+    submission->opcode = IORING_OP_ACCEPT;
+    submission->fd = loop->listenSocket;
+    submission->ioprio = IORING_ACCEPT_MULTISHOT;
+    submission->user_data = OPERATION_ACCEPT;
+    return 0;
+}
+
+static int ArmAcceptRetry(IoUringLoop *loop)
+{
+    struct io_uring_sqe *submission = GetSubmission(loop);
+    if (submission == NULL)
+    {
+        return -1;
+    }
+
+    loop->acceptRetry.tv_sec = 0;
+    loop->acceptRetry.tv_nsec = ACCEPT_RETRY_NANOSECONDS;
+
+    submission->opcode = IORING_OP_TIMEOUT;
+    submission->addr = (uint64_t)(uintptr_t)&loop->acceptRetry;
+    submission->len = 1;
+    submission->user_data = OPERATION_ACCEPT_RETRY;
+    return 0;
+}
+
+static int ArmWake(IoUringLoop *loop)
+{
+    struct io_uring_sqe *submission = GetSubmission(loop);
+    if (submission == NULL)
+    {
+        return -1;
+    }
+
+    submission->opcode = IORING_OP_READ;
+    submission->fd = loop->wakeDescriptor;
+    submission->addr = (uint64_t)(uintptr_t)&loop->wakeValue;
+    submission->len = sizeof(loop->wakeValue);
+    submission->user_data = (uint64_t)(uintptr_t)loop | OPERATION_WAKE;
+    return 0;
+}
+
+static int ArmReceive(IoUringLoop *loop, Connection *connection)
+{
+    struct io_uring_sqe *submission = GetSubmission(loop);
+    if (submission == NULL)
+    {
+        return -1;
+    }
+
+    submission->opcode = IORING_OP_RECV;
+    submission->fd = connection->socket;
+    submission->ioprio = IORING_RECV_MULTISHOT;
+    submission->flags = IOSQE_BUFFER_SELECT;
+    submission->buf_group = BUFFER_GROUP;
+    submission->user_data = (uint64_t)(uintptr_t)connection | OPERATION_RECV;
+
+    connection->pendingOperations++;
+    connection->receiveArmed = 1;
+    return 0;
+}
+
+// Ends the armed multishot recv; its last completion comes back with -ECANCELED.
+static int PauseReceive(IoUringLoop *loop, Connection *connection)
+{
+    struct io_uring_sqe *submission = GetSubmission(loop);
+    if (submission == NULL)
+    {
+        return -1;
+    }
+
+    submission->opcode = IORING_OP_ASYNC_CANCEL;
+    submission->addr = (uint64_t)(uintptr_t)connection | OPERATION_RECV;
+    submission->user_data = (uint64_t)(uintptr_t)connection | OPERATION_CANCEL;
+
+    connection->pendingOperations++;
+    connection->receivePaused = 1;
+    return 0;
+}
+
+static int SubmitSend(IoUringLoop *loop, Connection *connection)
+{
+    struct io_uring_sqe *submission = GetSubmission(loop);
+    if (submission == NULL)
+    {
+        return -1;
+    }
+
+    submission->opcode = IORING_OP_SEND;
+    submission->fd = connection->socket;
+    submission->addr = (uint64_t)(uintptr_t)(connection->output + connection->outputOffset);
+    submission->len = connection->outputLength - connection->outputOffset;
+    submission->msg_flags = MSG_NOSIGNAL;
+    submission->user_data = (uint64_t)(uintptr_t)connection | OPERATION_SEND;
+
+    connection->pendingOperations++;
+    return 0;
+}
+
+// Shutting the socket down ends the armed multishot recv; the connection is freed once no
+// operation and no worker still refer to it.
+static void StartClosing(Connection *connection)
+{
+    if (!connection->closing)
+    {
+        connection->closing = 1;
+        shutdown(connection->socket, SHUT_RDWR);
+    }
+}
+
+static void ReleaseIfDone(IoUringLoop *loop, Connection *connection)
+{
+    if (connection->closing && !connection->busy && connection->pendingOperations == 0)
+    {
+        loop->callbacks.onDisconnect(connection);
+        FreeConnection(connection);
+    }
+}
+
+// Called from worker threads: hands the response back to the ring that owns the connection.
+static void CompleteRequest(Connection *connection, char *response, int responseLength)
+{
+    IoUringLoop *loop = (IoUringLoop *)connection->owner;
+
+    connection->output = response;
+    connection->outputLength = responseLength;
+    connection->outputOffset = 0;
+
+    pthread_mutex_lock(&loop->completedMutex);
+    connection->nextCompleted = loop->completed;
+    loop->completed = connection;
+    pthread_mutex_unlock(&loop->completedMutex);
+
+    uint64_t wake = 1;
+    if (write(loop->wakeDescriptor, &wake, sizeof(wake)) == -1 && errno != EAGAIN)
+    {
+        printf("[Error][IoUring %d] Error at wake up: %s\n", loop->index, strerror(errno));
+        fflush(stdout);
+    }
+}
+
+static int DispatchNextFrame(IoUringLoop *loop, Connection *connection)
+{
+    int frameLength;
+    char *frame = NextFrame(&connection->input, &frameLength);
+    if (frame == NULL)
+    {
+        if (frameLength == -1)
+        {
+            printf("[Error][IoUring %d][Client %d] Frame too large.\n", loop->index, connection->clientId);
+            fflush(stdout);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    connection->busy = 1;
+    if (loop->callbacks.onRequest(connection, frame, frameLength) == -1)
+    {
+        connection->busy = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void HandleAccept(IoUringLoop *loop, int result, unsigned flags)
+{
+    if (result >= 0)
+    {
+        Connection *connection = CreateConnection(result);
+        if (connection == NULL)
+        {
+            close(result);
+        }
+        else
+        {
+            connection->owner = loop;
+            connection->complete = &CompleteRequest;
+            loop->callbacks.onConnect(connection);
+
+            if (ArmReceive(loop, connection) == -1)
+            {
+                StartClosing(connection);
+                ReleaseIfDone(loop, connection);
+            }
+        }
+    }
+    else if (result != -EINTR && result != -EAGAIN)
+    {
+        printf("[Error][IoUring %d] Error at accept(): %s\n", loop->index, strerror(-result));
+        fflush(stdout);
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        if (result == -EMFILE || result == -ENFILE || result == -ENOBUFS || result == -ENOMEM)
+        {
+            ArmAcceptRetry(loop);
+        }
+        else
+        {
+            ArmAccept(loop);
+        }
+    }
+}
+
+static int IsIdle(Connection *connection)
+{
+    return !connection->busy && connection->output == NULL;
+}
+
+// Receiving pauses while a request is in flight or its response is being sent and too much is buffered,
+// so a client pipelining requests holds at most about INPUT_PAUSE_SIZE bytes besides the frame in flight.
+static int LimitInput(IoUringLoop *loop, Connection *connection)
+{
+    if (!IsIdle(connection) && !connection->receivePaused &&
+        connection->input.length + connection->pendingInput.length >= INPUT_PAUSE_SIZE)
+    {
+        return PauseReceive(loop, connection);
+    }
+
+    return 0;
+}
+
+static void HandleReceive(IoUringLoop *loop, Connection *connection, int result, unsigned flags)
+{
+    int more = flags & IORING_CQE_F_MORE;
+    if (!more)
+    {
+        connection->pendingOperations--;
+        connection->receiveArmed = 0;
+    }
+
+    if (result > 0)
+    {
+        unsigned short bufferId = flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = loop->buffers + (size_t)bufferId * BUFFER_SIZE;
+
+        // The in-flight request's fields point into input, so input only grows while the connection is idle
+        if (!connection->closing)
+        {
+            FrameBuffer *target = IsIdle(connection) ? &connection->input : &connection->pendingInput;
+            if (AppendToFrameBuffer(target, data, result) != 0 || connection->pendingInput.length > MAX_FRAME_SIZE)
+            {
+                StartClosing(connection);
+            }
+        }
+        ProvideBuffer(loop, bufferId);
+
+        if (!connection->closing && IsIdle(connection) && DispatchNextFrame(loop, connection) == -1)
+        {
+            StartClosing(connection);
+        }
+
+        if (!connection->closing && LimitInput(loop, connection) == -1)
+        {
+            StartClosing(connection);
+        }
+    }
+    else if (result != -ENOBUFS && result != -ECANCELED)
+    {
+        StartClosing(connection);
+    }
+
+    if (!more && !connection->closing && !connection->receivePaused && ArmReceive(loop, connection) == -1)
+    {
+        StartClosing(connection);
+    }
+
+    ReleaseIfDone(loop, connection);
+}
+
+static void HandleCancel(IoUringLoop *loop, Connection *connection)
+{
+    connection->pendingOperations--;
+    ReleaseIfDone(loop, connection);
+}
+
+// Called once a response is sent: moves what arrived meanwhile to input, dispatches the next frame
+// and resumes receiving when the connection is idle again.
+static int ResumeConnection(IoUringLoop *loop, Connection *connection)
+{
+    if (connection->pendingInput.length > 0)
+    {
+        if (AppendToFrameBuffer(&connection->input, connection->pendingInput.data, connection->pendingInput.length) != 0)
+        {
+            return -1;
+        }
+        FreeFrameBuffer(&connection->pendingInput);
+    }
+
+    if (DispatchNextFrame(loop, connection) == -1)
+    {
+        return -1;
+    }
+
+    if (IsIdle(connection) && connection->receivePaused)
+    {
+        connection->receivePaused = 0;
+        if (!connection->receiveArmed)
+        {
+            return ArmReceive(loop, connection);
+        }
+        return 0;
+    }
+
+    return LimitInput(loop, connection);
+}
+
+static void HandleSend(IoUringLoop *loop, Connection *connection, int result)
+{
+    connection->pendingOperations--;
+
+    if (result < 0)
+    {
+        StartClosing(connection);
+    }
+    else if (!connection->closing)
+    {
+        connection->outputOffset += result;
+        if (connection->outputOffset < connection->outputLength)
+        {
+            if (SubmitSend(loop, connection) == -1)
+            {
+                StartClosing(connection);
+            }
+        }
+        else
+        {
+            ReturnBuffer(connection->output);
+            connection->output = NULL;
+            connection->outputLength = 0;
+            connection->outputOffset = 0;
+
+            if (ResumeConnection(loop, connection) == -1)
+            {
+                StartClosing(connection);
+            }
+        }
+    }
+
+    ReleaseIfDone(loop, connection);
+}
+
+static void ProcessCompletedRequests(IoUringLoop *loop)
+{
+    pthread_mutex_lock(&loop->completedMutex);
+    Connection *connection = loop->completed;
+    loop->completed = NULL;
+    pthread_mutex_unlock(&loop->completedMutex);
+
+    while (connection != NULL)
+    {
+        Connection *next = connection->nextCompleted;
+        connection->nextCompleted = NULL;
+        connection->busy = 0;
+        ConsumeFrame(&connection->input);
+
+        if (!connection->closing && (connection->output == NULL || SubmitSend(loop, connection) == -1))
+        {
+            StartClosing(connection);
+        }
+        ReleaseIfDone(loop, connection);
+
+        connection = next;
+    }
+
+    ArmWake(loop);
+}
+
+static void *RunIoUringLoop(void *arg)
+{
+    IoUringLoop *loop = (IoUringLoop *)arg;
+
+    if (ArmAccept(loop) == -1 || ArmWake(loop) == -1)
+    {
+        return NULL;
+    }
+
+    while (1)
+    {
+        int submitted = IoUringEnter(loop->ringDescriptor, loop->pendingSubmissions, 1, IORING_ENTER_GETEVENTS);
+        if (submitted < 0)
+        {
+            if (errno == EINTR || errno == EBUSY || errno == EAGAIN)
+            {
+                continue;
+            }
+
+            printf("[Error][IoUring %d] io_uring_enter() error: %s\n", loop->index, strerror(errno));
+            fflush(stdout);
+            break;
+        }
+        loop->pendingSubmissions -= submitted;
+
+        unsigned head = *loop->completionHead;
+        unsigned tail = __atomic_load_n(loop->completionTail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct io_uring_cqe completion = loop->completions[head & loop->completionMask];
+            head++;
+            __atomic_store_n(loop->completionHead, head, __ATOMIC_RELEASE);
+
+            int operation = completion.user_data & OPERATION_MASK;
+            void *target = (void *)(uintptr_t)(completion.user_data & ~OPERATION_MASK);
+            switch (operation)
+            {
+            case OPERATION_ACCEPT:
+                HandleAccept(loop, completion.res, completion.flags);
+                break;
+            case OPERATION_RECV:
+                HandleReceive(loop, (Connection *)target, completion.res, completion.flags);
+                break;
+            case OPERATION_SEND:
+                HandleSend(loop, (Connection *)target, completion.res);
+                break;
+            case OPERATION_WAKE:
+                ProcessCompletedRequests(loop);
+                break;
+            case OPERATION_CANCEL:
+                HandleCancel(loop, (Connection *)target);
+                break;
+            case OPERATION_ACCEPT_RETRY:
+                ArmAccept(loop);
+                break;
+            default:
+                break;
+            }
+
+            tail = __atomic_load_n(loop->completionTail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    return NULL;
+}
+
+// Returns NULL when io_uring (or one of the features used here) is not available, so the caller can fall back.
+IoUringLoop *CreateIoUringLoops(int *listenSockets, int loopsCount, EventLoopCallbacks callbacks)
+{
+    if (loopsCount <= 0)
+    {
+        return NULL;
+    }
+
+    IoUringLoop *loops = (IoUringLoop *)calloc(loopsCount, sizeof(IoUringLoop));
+    if (loops == NULL)
+    {
+        printf("[Error][IoUring] Error at allocate loops.\n");
+        fflush(stdout);
+        return NULL;
+    }
+
+    for (int i = 0; i < loopsCount; i++)
+    {
+        loops[i].index = i;
+        loops[i].listenSocket = listenSockets[i];
+        loops[i].callbacks = callbacks;
+        loops[i].completed = NULL;
+        loops[i].ringDescriptor = -1;
+        loops[i].ring = MAP_FAILED;
+        loops[i].submissions = MAP_FAILED;
+        loops[i].bufferRing = MAP_FAILED;
+        loops[i].buffers = NULL;
+        pthread_mutex_init(&loops[i].completedMutex, NULL);
+
+        loops[i].wakeDescriptor = eventfd(0, EFD_NONBLOCK);
+        if (loops[i].wakeDescriptor == -1)
+        {
+            printf("[Error][IoUring %d] eventfd() error: %s\n", i, strerror(errno));
+        }
+
+        if (loops[i].wakeDescriptor == -1 || InitRing(&loops[i]) != 0)
+        {
+            for (int j = 0; j <= i; j++)
+            {
+                FreeIoUringLoop(&loops[j]);
+            }
+            free(loops);
+
+            fflush(stdout);
+            return NULL;
+        }
+    }
+
+    return loops;
+}
+
+int RunIoUringLoops(IoUringLoop *loops, int loopsCount)
+{
+    for (int i = 1; i < loopsCount; i++)
+    {
+        int threadCreationResult = pthread_create(&loops[i].thread, NULL, &RunIoUringLoop, &loops[i]);
+        if (threadCreationResult != 0)
+        {
+            printf("[Error][IoUring %d] Failed to create thread: %s\n", i, strerror(threadCreationResult));
+            return -1;
+        }
+    }
+
+    RunIoUringLoop(&loops[0]);
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef IO_URING_UTILS_H
+#define IO_URING_UTILS_H
+
+#include "event_loop_utils.h"
+
+typedef struct IoUringLoop IoUringLoop;
+
+IoUringLoop *CreateIoUringLoops(int *listenSockets, int loopsCount, EventLoopCallbacks callbacks);
+int RunIoUringLoops(IoUringLoop *loops, int loopsCount);
+
+#endif
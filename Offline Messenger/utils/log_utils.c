@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "log_utils.h"
+
+#define LOG_BATCH_SIZE (64 * 1024)
+
+// A thread logs to a single logger, like it reads through a single DB connection.
+static __thread LogRing *threadRing = NULL;
+
+static void UpdateClock(Logger *logger)
+{
+    time_t currentTime;
+    struct tm timeInfo;
+    char timeString[16];
+
+    time(&currentTime);
+    localtime_r(&currentTime, &timeInfo);
+    strftime(timeString, sizeof(timeString), "%H:%M:%S", &timeInfo);
+
+    unsigned long long clock;
+    memcpy(&clock, timeString, sizeof(clock));
+    __atomic_store_n(&logger->clock, clock, __ATOMIC_RELAXED);
+}
+
+// Called when a logging thread exits, the logger thread recycles the ring once it is drained.
+static void AbandonRing(void *arg)
+{
+    LogRing *ring = (LogRing *)arg;
+    __atomic_store_n(&ring->abandoned, 1, __ATOMIC_RELEASE);
+}
+
+static LogRing *AttachRing(Logger *logger)
+{
+    pthread_mutex_lock(&logger->ringsMutex);
+    LogRing *ring = logger->freeRings;
+    if (ring != NULL)
+    {
+        logger->freeRings = ring->next;
+    }
+    else
+    {
+        ring = (LogRing *)malloc(sizeof(LogRing));
+    }
+
+    if (ring != NULL)
+    {
+        ring->head = 0;
+        ring->tail = 0;
+        ring->dropped = 0;
+        ring->abandoned = 0;
+        ring->next = logger->rings;
+        logger->rings = ring;
+    }
+    pthread_mutex_unlock(&logger->ringsMutex);
+
+    if (ring != NULL)
+    {
+        pthread_setspecific(logger->ringKey, ring);
+    }
+
+    threadRing = ring;
+    return ring;
+}
+
+static void WriteBatch(Logger *logger, const char *batch, int length)
+{
+    int offset = 0;
+    while (offset < length)
+    {
+        ssize_t written = write(logger->file, batch + offset, length - offset);
+        if (written <= 0)
+        {
+            printf("[SERVER][ERROR] Log Write error.\n");
+            fflush(stdout);
+            return;
+        }
+        offset += written;
+    }
+}
+
+// Moves every queued entry to the file in batches. Called by the logger thread only.
+static void DrainRings(Logger *logger)
+{
+    static char batch[LOG_BATCH_SIZE];
+    int length = 0;
+    unsigned int dropped = 0;
+
+    pthread_mutex_lock(&logger->ringsMutex);
+    LogRing **link = &logger->rings;
+    while (*link != NULL)
+    {
+        LogRing *ring = *link;
+        int abandoned = __atomic_load_n(&ring->abandoned, __ATOMIC_ACQUIRE);
+        unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        for (unsigned int tail = ring->tail; tail != head; tail++)
+        {
+            int entry = tail % LOG_RING_ENTRIES;
+            if (length + ring->lengths[entry] > LOG_BATCH_SIZE)
+            {
+                WriteBatch(logger, batch, length);
+                length = 0;
+            }
+            memcpy(batch + length, ring->entries[entry], ring->lengths[entry]);
+            length += ring->lengths[entry];
+        }
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+        dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+
+        if (abandoned)
+        {
+            *link = ring->next;
+            ring->next = logger->freeRings;
+            logger->freeRings = ring;
+            continue;
+        }
+        link = &ring->next;
+    }
+    pthread_mutex_unlock(&logger->ringsMutex);
+
+    if (dropped > 0 && LOG_BATCH_SIZE - length >= LOG_ENTRY_SIZE)
+    {
+        length += snprintf(batch + length, LOG_ENTRY_SIZE, "[Logger] - %u events dropped\n", dropped);
+    }
+
+    if (length > 0)
+    {
+        WriteBatch(logger, batch, length);
+    }
+}
+
+static void *RunLogger(void *arg)
+{
+    Logger *logger = (Logger *)arg;
+
+    while (!__atomic_load_n(&logger->stopping, __ATOMIC_ACQUIRE))
+    {
+        usleep(logger->flushIntervalMicroseconds);
+        UpdateClock(logger);
+        DrainRings(logger);
+    }
+
+    DrainRings(logger);
+    return NULL;
+}
+
+Logger *CreateLogger(const char *fileName, int flushIntervalMicroseconds)
+{
+    Logger *logger = (Logger *)calloc(1, sizeof(Logger));
+    if (logger == NULL)
+    {
+        return NULL;
+    }
+
+    logger->flushIntervalMicroseconds = flushIntervalMicroseconds;
+    logger->file = open(fileName, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (logger->file == -1)
+    {
+        free(logger);
+        return NULL;
+    }
+
+    if (pthread_key_create(&logger->ringKey, &AbandonRing) != 0)
+    {
+        close(logger->file);
+        free(logger);
+        return NULL;
+    }
+    pthread_mutex_init(&logger->ringsMutex, NULL);
+
+    UpdateClock(logger);
+    if (pthread_create(&logger->thread, NULL, &RunLogger, logger) != 0)
+    {
+        DestroyLogger(logger);
+        return NULL;
+    }
+    logger->threadStarted = 1;
+
+    return logger;
+}
+
+// Formats "[Client id][HH:MM:SS] - event" into the calling thread's ring, truncated to LOG_ENTRY_SIZE.
+void WriteLog(Logger *logger, int clientId, const char *format, ...)
+{
+    LogRing *ring = threadRing != NULL ? threadRing : AttachRing(logger);
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    unsigned int head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_ENTRIES)
+    {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    char clock[9];
+    unsigned long long packedClock = __atomic_load_n(&logger->clock, __ATOMIC_RELAXED);
+    memcpy(clock, &packedClock, 8);
+    clock[8] = '\0';
+
+    int entry = head % LOG_RING_ENTRIES;
+    char *text = ring->entries[entry];
+    int length = snprintf(text, LOG_ENTRY_SIZE, "[Client %d][%s] - ", clientId, clock);
+
+    va_list args;
+    va_start(args, format);
+    length += vsnprintf(text + length, LOG_ENTRY_SIZE - length, format, args);
+    va_end(args);
+
+    if (length > LOG_ENTRY_SIZE - 2)
+    {
+        length = LOG_ENTRY_SIZE - 2;
+    }
+    text[length++] = '\n';
+    ring->lengths[entry] = length;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Writes what is still queued and closes the file. Threads must have stopped logging.
+void DestroyLogger(Logger *logger)
+{
+    if (logger == NULL)
+    {
+        return;
+    }
+
+    if (logger->threadStarted)
+    {
+        __atomic_store_n(&logger->stopping, 1, __ATOMIC_RELEASE);
+        pthread_join(logger->thread, NULL);
+    }
+
+    LogRing *lists[] = {logger->rings, logger->freeRings};
+    for (int i = 0; i < 2; i++)
+    {
+        LogRing *ring = lists[i];
+        while (ring != NULL)
+        {
+            LogRing *next = ring->next;
+            free(ring);
+            ring = next;
+        }
+    }
+
+    pthread_key_delete(logger->ringKey);
+    pthread_mutex_destroy(&logger->ringsMutex);
+    close(logger->file);
+    free(logger);
+}
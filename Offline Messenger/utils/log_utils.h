@@ -0,0 +1,46 @@
+#ifndef LOG_UTILS_H
+#define LOG_UTILS_H
+
+#include <pthread.h>
+
+#define LOG_ENTRY_SIZE 256
+#define LOG_RING_ENTRIES 128
+
+// Events of one thread: the thread is the only producer and the logger thread the only consumer,
+// so head and tail are enough to hand entries over without a lock.
+typedef struct LogRing
+{
+    char entries[LOG_RING_ENTRIES][LOG_ENTRY_SIZE];
+    unsigned short lengths[LOG_RING_ENTRIES];
+    unsigned int head;
+    unsigned int tail;
+    unsigned int dropped;
+    int abandoned;
+    struct LogRing *next;
+} LogRing;
+
+// Events are formatted into the calling thread's ring and written to the file, kept open, by a background thread
+// in batches. A full ring drops the event instead of waiting; the drops are counted in the file.
+typedef struct Logger
+{
+    int file;
+    pthread_t thread;
+    int threadStarted;
+    int flushIntervalMicroseconds;
+
+    // Rings of the logging threads; rings of exited threads are drained and reused by new threads.
+    LogRing *rings;
+    LogRing *freeRings;
+    pthread_mutex_t ringsMutex;
+    pthread_key_t ringKey;
+
+    // "HH:MM:SS" packed in one word, refreshed by the logger thread on every flush
+    unsigned long long clock;
+    int stopping;
+} Logger;
+
+Logger *CreateLogger(const char *fileName, int flushIntervalMicroseconds);
+void WriteLog(Logger *logger, int clientId, const char *format, ...);
+void DestroyLogger(Logger *logger);
+
+#endif
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "communication_utils.h"
+#include "page_cache_utils.h"
+
+// A page is stored in one block: the rows, whose strings hold offsets into the block, then their strings,
+// then the cursor of the key. A hit copies the rows and strings in one memcpy and turns the offsets back into pointers.
+struct CachedPage
+{
+    int commandNumber;
+    int viewerId;
+    int peerId;
+    int argument;
+    const char *cursor;
+    unsigned long long version;
+    int rowsCount;
+    int rowsSize;
+    char data[];
+};
+
+static unsigned int HashKey(const PageKey *key)
+{
+    unsigned int hash = 2166136261u;
+    int numbers[] = {key->commandNumber, key->viewerId, key->peerId, key->argument};
+    for (int i = 0; i < 4; i++)
+    {
+        hash = (hash ^ (unsigned int)numbers[i]) * 16777619u;
+    }
+
+    for (const char *character = key->cursor; character != NULL && *character != '\0'; character++)
+    {
+        hash = (hash ^ (unsigned char)*character) * 16777619u;
+    }
+
+    return hash;
+}
+
+static int ConversationGenerationIndex(int userId, int peerId)
+{
+    unsigned int low = userId < peerId ? userId : peerId;
+    unsigned int high = userId < peerId ? peerId : userId;
+    return ((low * 2654435761u) ^ (high * 40503u)) % PAGE_CACHE_GENERATIONS;
+}
+
+// The generations a page depends on: its conversation or its viewer's users pages, and the shared ones.
+static unsigned long long PageVersion(PageCache *cache, const PageKey *key)
+{
+    unsigned int own;
+    unsigned int shared = __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+    if (IsMessagesListCommand(key->commandNumber))
+    {
+        own = __atomic_load_n(&cache->conversationGenerations[ConversationGenerationIndex(key->viewerId, key->peerId)], __ATOMIC_ACQUIRE);
+    }
+    else
+    {
+        own = __atomic_load_n(&cache->userGenerations[(unsigned int)key->viewerId % PAGE_CACHE_GENERATIONS], __ATOMIC_ACQUIRE);
+        shared += __atomic_load_n(&cache->directoryGeneration, __ATOMIC_ACQUIRE);
+    }
+
+    return ((unsigned long long)own << 32) | shared;
+}
+
+static int MatchesKey(const CachedPage *page, const PageKey *key)
+{
+    if (page->commandNumber != key->commandNumber || page->viewerId != key->viewerId || page->peerId != key->peerId ||
+        page->argument != key->argument)
+    {
+        return 0;
+    }
+
+    if (page->cursor == NULL || key->cursor == NULL)
+    {
+        return page->cursor == key->cursor;
+    }
+
+    return strcmp(page->cursor, key->cursor) == 0;
+}
+
+PageCache *CreatePageCache(int slotsCount)
+{
+    if (slotsCount <= 0)
+    {
+        return NULL;
+    }
+
+    PageCache *cache = (PageCache *)calloc(1, sizeof(PageCache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    cache->slots = (CachedPage **)calloc(slotsCount, sizeof(CachedPage *));
+    if (cache->slots == NULL)
+    {
+        free(cache);
+        return NULL;
+    }
+    cache->slotsCount = slotsCount;
+
+    for (int i = 0; i < PAGE_CACHE_LOCKS; i++)
+    {
+        pthread_mutex_init(&cache->locks[i], NULL);
+    }
+
+    return cache;
+}
+
+// Returns 1 and fills the rows of response, allocated in arena, when the page is cached and still valid.
+// On a miss, version is the one to store the page with once it is read; it is taken before the page is read,
+// so a write committed meanwhile makes the stored page invalid instead of stale.
+int LookupPage(PageCache *cache, const PageKey *key, Arena *arena, ServerResponse *response, unsigned long long *version)
+{
+    *version = PageVersion(cache, key);
+
+    int slot = HashKey(key) % cache->slotsCount;
+    pthread_mutex_t *lock = &cache->locks[slot % PAGE_CACHE_LOCKS];
+    char *rows = NULL;
+    int rowsCount = 0;
+
+    pthread_mutex_lock(lock);
+    const CachedPage *page = cache->slots[slot];
+    if (page != NULL && page->version == *version && MatchesKey(page, key))
+    {
+        rows = (char *)ArenaAlloc(arena, page->rowsSize);
+        if (rows != NULL)
+        {
+            memcpy(rows, page->data, page->rowsSize);
+            rowsCount = page->rowsCount;
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    if (rows == NULL)
+    {
+        __atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    if (IsMessagesListCommand(key->commandNumber))
+    {
+        response->messages = (MessageStructure *)rows;
+        for (int i = 0; i < rowsCount; i++)
+        {
+            response->messages[i].sender = rows + (uintptr_t)response->messages[i].sender;
+            response->messages[i].message = rows + (uintptr_t)response->messages[i].message;
+        }
+    }
+    else
+    {
+        response->users = (UserViewStructure *)rows;
+        for (int i = 0; i < rowsCount; i++)
+        {
+            response->users[i].username = rows + (uintptr_t)response->users[i].username;
+        }
+    }
+    response->rowsCount = rowsCount;
+
+    __atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+static char *CopyString(char *base, int *offset, const char *text)
+{
+    int length = strlen(text) + 1;
+    memcpy(base + *offset, text, length);
+
+    char *position = (char *)(uintptr_t)*offset;
+    *offset += length;
+    return position;
+}
+
+// Keeps the rows of response for the page, replacing whatever page used the slot.
+void StorePage(PageCache *cache, const PageKey *key, unsigned long long version, const ServerResponse *response)
+{
+    int messagesPage = IsMessagesListCommand(key->commandNumber);
+    size_t rowSize = messagesPage ? sizeof(MessageStructure) : sizeof(UserViewStructure);
+    size_t rowsSize = response->rowsCount * rowSize;
+    for (int i = 0; i < response->rowsCount; i++)
+    {
+        if (messagesPage)
+        {
+            rowsSize += strlen(response->messages[i].sender) + strlen(response->messages[i].message) + 2;
+        }
+        else
+        {
+            rowsSize += strlen(response->users[i].username) + 1;
+        }
+    }
+
+    size_t cursorSize = key->cursor != NULL ? strlen(key->cursor) + 1 : 0;
+    if (rowsSize + cursorSize > PAGE_CACHE_MAX_PAGE_SIZE)
+    {
+        return;
+    }
+
+    CachedPage *page = (CachedPage *)malloc(sizeof(CachedPage) + rowsSize + cursorSize);
+    if (page == NULL)
+    {
+        return;
+    }
+
+    page->commandNumber = key->commandNumber;
+    page->viewerId = key->viewerId;
+    page->peerId = key->peerId;
+    page->argument = key->argument;
+    page->cursor = key->cursor != NULL ? memcpy(page->data + rowsSize, key->cursor, cursorSize) : NULL;
+    page->version = version;
+    page->rowsCount = response->rowsCount;
+    page->rowsSize = rowsSize;
+
+    int offset = response->rowsCount * rowSize;
+    for (int i = 0; i < response->rowsCount; i++)
+    {
+        if (messagesPage)
+        {
+            MessageStructure *message = &((MessageStructure *)page->data)[i];
+            *message = response->messages[i];
+            message->sender = CopyString(page->data, &offset, response->messages[i].sender);
+            message->message = CopyString(page->data, &offset, response->messages[i].message);
+        }
+        else
+        {
+            UserViewStructure *user = &((UserViewStructure *)page->data)[i];
+            *user = response->users[i];
+            user->username = CopyString(page->data, &offset, response->users[i].username);
+        }
+    }
+
+    int slot = HashKey(key) % cache->slotsCount;
+    pthread_mutex_t *lock = &cache->locks[slot % PAGE_CACHE_LOCKS];
+
+    pthread_mutex_lock(lock);
+    CachedPage *replaced = cache->slots[slot];
+    cache->slots[slot] = page;
+    pthread_mutex_unlock(lock);
+
+    free(replaced);
+}
+
+// Called once a change to the conversation is committed: its messages or their read state changed.
+void InvalidateConversationPages(PageCache *cache, int userId, int peerId)
+{
+    __atomic_fetch_add(&cache->conversationGenerations[ConversationGenerationIndex(userId, peerId)], 1, __ATOMIC_RELEASE);
+}
+
+// Called once the unread counts of the user changed.
+void InvalidateUserPages(PageCache *cache, int userId)
+{
+    __atomic_fetch_add(&cache->userGenerations[(unsigned int)userId % PAGE_CACHE_GENERATIONS], 1, __ATOMIC_RELEASE);
+}
+
+// Called once a user is added: every users page may list it.
+void InvalidateUsersPages(PageCache *cache)
+{
+    __atomic_fetch_add(&cache->directoryGeneration, 1, __ATOMIC_RELEASE);
+}
+
+void InvalidatePages(PageCache *cache)
+{
+    __atomic_fetch_add(&cache->generation, 1, __ATOMIC_RELEASE);
+}
+
+void GetPageCacheStats(PageCache *cache, unsigned long long *hits, unsigned long long *misses)
+{
+    *hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+}
+
+void FreePageCache(PageCache *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < cache->slotsCount; i++)
+    {
+        free(cache->slots[i]);
+    }
+
+    for (int i = 0; i < PAGE_CACHE_LOCKS; i++)
+    {
+        pthread_mutex_destroy(&cache->locks[i]);
+    }
+
+    free(cache->slots);
+    free(cache);
+}
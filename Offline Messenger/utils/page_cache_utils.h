@@ -0,0 +1,56 @@
+#ifndef PAGE_CACHE_UTILS_H
+#define PAGE_CACHE_UTILS_H
+
+#include <pthread.h>
+
+#include "communication_types.h"
+#include "arena_utils.h"
+
+#define PAGE_CACHE_LOCKS 64
+#define PAGE_CACHE_GENERATIONS 4096
+// Pages larger than this, long messages mostly, are not kept.
+#define PAGE_CACHE_MAX_PAGE_SIZE (64 * 1024)
+
+// A list page as requested: the command tells the kind of page and how argument or cursor are read.
+// peerId is 0 for users pages, cursor is only set for View_Users_After.
+typedef struct PageKey
+{
+    int commandNumber;
+    int viewerId;
+    int peerId;
+    int argument;
+    const char *cursor;
+} PageKey;
+
+typedef struct CachedPage CachedPage;
+
+// Pages of View_Messages/View_Users and their cursor variants, in a fixed number of slots that a newer page
+// replaces. A page is valid while the generations it was read under are unchanged: writes bump the
+// generation of the conversation or of the viewer's users pages once committed, so stale pages are never
+// served and no page has to be searched for. Generations are shared by the ids hashing to the same counter.
+typedef struct PageCache
+{
+    CachedPage **slots;
+    int slotsCount;
+    pthread_mutex_t locks[PAGE_CACHE_LOCKS];
+
+    unsigned int conversationGenerations[PAGE_CACHE_GENERATIONS];
+    unsigned int userGenerations[PAGE_CACHE_GENERATIONS];
+    unsigned int directoryGeneration;
+    unsigned int generation;
+
+    unsigned long long hits;
+    unsigned long long misses;
+} PageCache;
+
+PageCache *CreatePageCache(int slotsCount);
+int LookupPage(PageCache *cache, const PageKey *key, Arena *arena, ServerResponse *response, unsigned long long *version);
+void StorePage(PageCache *cache, const PageKey *key, unsigned long long version, const ServerResponse *response);
+void InvalidateConversationPages(PageCache *cache, int userId, int peerId);
+void InvalidateUserPages(PageCache *cache, int userId);
+void InvalidateUsersPages(PageCache *cache);
+void InvalidatePages(PageCache *cache);
+void GetPageCacheStats(PageCache *cache, unsigned long long *hits, unsigned long long *misses);
+void FreePageCache(PageCache *cache);
+
+#endif
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "thread_pool_utils.h"
+
+static void *RunWorker(void *arg)
+{
+    ThreadPool *pool = (ThreadPool *)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->queueLength == 0 && !pool->stopping)
+        {
+            pthread_cond_wait(&pool->jobAvailable, &pool->mutex);
+        }
+
+        if (pool->queueLength == 0 && pool->stopping)
+        {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+
+        Job job = pool->queue[pool->queueHead];
+        pool->queueHead = (pool->queueHead + 1) % pool->queueCapacity;
+        pool->queueLength--;
+        pthread_mutex_unlock(&pool->mutex);
+
+        job.function(job.arg);
+    }
+
+    return NULL;
+}
+
+ThreadPool *CreateThreadPool(int threadsCount, int queueCapacity)
+{
+    if (threadsCount <= 0 || queueCapacity <= 0)
+    {
+        return NULL;
+    }
+
+    ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+
+    pool->threads = (pthread_t *)malloc(threadsCount * sizeof(pthread_t));
+    pool->queue = (Job *)malloc(queueCapacity * sizeof(Job));
+    if (pool->threads == NULL || pool->queue == NULL)
+    {
+        free(pool->threads);
+        free(pool->queue);
+        free(pool);
+        return NULL;
+    }
+
+    pool->queueCapacity = queueCapacity;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->jobAvailable, NULL);
+
+    for (int i = 0; i < threadsCount; i++)
+    {
+        int threadCreationResult = pthread_create(&pool->threads[i], NULL, &RunWorker, pool);
+        if (threadCreationResult != 0)
+        {
+            printf("[Error][ThreadPool] Failed to create worker %d: %s\n", i, strerror(threadCreationResult));
+            fflush(stdout);
+            DestroyThreadPool(pool);
+            return NULL;
+        }
+        pool->threadsCount++;
+    }
+
+    return pool;
+}
+
+// Never blocks: a full queue rejects the job so the caller can answer "busy" right away.
+int SubmitJob(ThreadPool *pool, JobFunction function, void *arg)
+{
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->stopping || pool->queueLength == pool->queueCapacity)
+    {
+        pthread_mutex_unlock(&pool->mutex);
+        return -1;
+    }
+
+    int tail = (pool->queueHead + pool->queueLength) % pool->queueCapacity;
+    pool->queue[tail].function = function;
+    pool->queue[tail].arg = arg;
+    pool->queueLength++;
+
+    pthread_cond_signal(&pool->jobAvailable);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return 0;
+}
+
+void DestroyThreadPool(ThreadPool *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->jobAvailable);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->threadsCount; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->jobAvailable);
+    free(pool->threads);
+    free(pool->queue);
+    free(pool);
+}
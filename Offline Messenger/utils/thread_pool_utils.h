@@ -0,0 +1,33 @@
+#ifndef THREAD_POOL_UTILS_H
+#define THREAD_POOL_UTILS_H
+
+#include <pthread.h>
+
+typedef void (*JobFunction)(void *arg);
+
+typedef struct Job
+{
+    JobFunction function;
+    void *arg;
+} Job;
+
+typedef struct ThreadPool
+{
+    pthread_t *threads;
+    int threadsCount;
+
+    Job *queue;
+    int queueCapacity;
+    int queueHead;
+    int queueLength;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t jobAvailable;
+    int stopping;
+} ThreadPool;
+
+ThreadPool *CreateThreadPool(int threadsCount, int queueCapacity);
+int SubmitJob(ThreadPool *pool, JobFunction function, void *arg);
+void DestroyThreadPool(ThreadPool *pool);
+
+#endif
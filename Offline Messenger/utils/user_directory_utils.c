@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "user_directory_utils.h"
+
+#define INITIAL_BUCKETS_COUNT 1024
+
+// FNV-1a
+static unsigned int HashUsername(const char *username)
+{
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)username; *c != '\0'; c++)
+    {
+        hash = (hash ^ *c) * 16777619u;
+    }
+
+    return hash;
+}
+
+// Called with the lock held.
+static UserEntry *FindEntry(UserDirectory *directory, const char *username)
+{
+    UserEntry *entry = directory->buckets[HashUsername(username) % directory->bucketsCount];
+    while (entry != NULL && strcmp(entry->username, username) != 0)
+    {
+        entry = entry->next;
+    }
+
+    return entry;
+}
+
+UserDirectory *CreateUserDirectory()
+{
+    UserDirectory *directory = (UserDirectory *)calloc(1, sizeof(UserDirectory));
+    if (directory == NULL)
+    {
+        return NULL;
+    }
+
+    directory->bucketsCount = INITIAL_BUCKETS_COUNT;
+    directory->buckets = (UserEntry **)calloc(directory->bucketsCount, sizeof(UserEntry *));
+    if (directory->buckets == NULL)
+    {
+        free(directory);
+        return NULL;
+    }
+
+    pthread_rwlock_init(&directory->lock, NULL);
+    return directory;
+}
+
+// Doubles the buckets once the table is full, keeping lookups O(1). Called with the write lock held.
+static int GrowBuckets(UserDirectory *directory)
+{
+    int bucketsCount = directory->bucketsCount * 2;
+    UserEntry **buckets = (UserEntry **)calloc(bucketsCount, sizeof(UserEntry *));
+    if (buckets == NULL)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < directory->bucketsCount; i++)
+    {
+        UserEntry *entry = directory->buckets[i];
+        while (entry != NULL)
+        {
+            UserEntry *next = entry->next;
+            unsigned int bucket = HashUsername(entry->username) % bucketsCount;
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(directory->buckets);
+    directory->buckets = buckets;
+    directory->bucketsCount = bucketsCount;
+    return 0;
+}
+
+static int GrowEntriesById(UserDirectory *directory, int id)
+{
+    int capacity = directory->entriesByIdCapacity > 0 ? directory->entriesByIdCapacity : INITIAL_BUCKETS_COUNT;
+    while (capacity <= id)
+    {
+        capacity *= 2;
+    }
+
+    UserEntry **entriesById = (UserEntry **)realloc(directory->entriesById, capacity * sizeof(UserEntry *));
+    if (entriesById == NULL)
+    {
+        return -1;
+    }
+
+    memset(entriesById + directory->entriesByIdCapacity, 0, (capacity - directory->entriesByIdCapacity) * sizeof(UserEntry *));
+    directory->entriesById = entriesById;
+    directory->entriesByIdCapacity = capacity;
+    return 0;
+}
+
+int AddUser(UserDirectory *directory, int id, const char *username, const char *password)
+{
+    if (id <= 0)
+    {
+        return -1;
+    }
+
+    UserEntry *entry = (UserEntry *)malloc(sizeof(UserEntry));
+    if (entry == NULL)
+    {
+        return -1;
+    }
+
+    entry->id = id;
+    entry->username = strdup(username);
+    entry->password = password != NULL ? strdup(password) : NULL;
+    if (entry->username == NULL || (password != NULL && entry->password == NULL))
+    {
+        free(entry->username);
+        free(entry->password);
+        free(entry);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&directory->lock);
+    if ((id >= directory->entriesByIdCapacity && GrowEntriesById(directory, id) != 0) ||
+        (directory->usersCount >= directory->bucketsCount && GrowBuckets(directory) != 0))
+    {
+        pthread_rwlock_unlock(&directory->lock);
+        free(entry->username);
+        free(entry->password);
+        free(entry);
+        return -1;
+    }
+
+    unsigned int bucket = HashUsername(username) % directory->bucketsCount;
+    entry->next = directory->buckets[bucket];
+    directory->buckets[bucket] = entry;
+    directory->entriesById[id] = entry;
+    directory->usersCount++;
+    pthread_rwlock_unlock(&directory->lock);
+
+    return 0;
+}
+
+// Returns the user id, -1 when there is no such user.
+int FindUserId(UserDirectory *directory, const char *username)
+{
+    int id = -1;
+
+    pthread_rwlock_rdlock(&directory->lock);
+    UserEntry *entry = FindEntry(directory, username);
+    if (entry != NULL)
+    {
+        id = entry->id;
+    }
+    pthread_rwlock_unlock(&directory->lock);
+
+    return id;
+}
+
+// Returns the user id when the user exists and has this password, -1 otherwise.
+int AuthenticateUser(UserDirectory *directory, const char *username, const char *password)
+{
+    int id = -1;
+
+    pthread_rwlock_rdlock(&directory->lock);
+    UserEntry *entry = FindEntry(directory, username);
+    if (entry != NULL && entry->password != NULL && strcmp(entry->password, password) == 0)
+    {
+        id = entry->id;
+    }
+    pthread_rwlock_unlock(&directory->lock);
+
+    return id;
+}
+
+int GetDirectoryUsersCount(UserDirectory *directory)
+{
+    pthread_rwlock_rdlock(&directory->lock);
+    int usersCount = directory->usersCount;
+    pthread_rwlock_unlock(&directory->lock);
+
+    return usersCount;
+}
+
+// Returns the interned username, NULL when there is no such user.
+const char *FindUsername(UserDirectory *directory, int id)
+{
+    const char *username = NULL;
+
+    pthread_rwlock_rdlock(&directory->lock);
+    if (id > 0 && id < directory->entriesByIdCapacity && directory->entriesById[id] != NULL)
+    {
+        username = directory->entriesById[id]->username;
+    }
+    pthread_rwlock_unlock(&directory->lock);
+
+    return username;
+}
+
+void FreeUserDirectory(UserDirectory *directory)
+{
+    if (directory == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < directory->bucketsCount; i++)
+    {
+        UserEntry *entry = directory->buckets[i];
+        while (entry != NULL)
+        {
+            UserEntry *next = entry->next;
+            free(entry->username);
+            free(entry->password);
+            free(entry);
+            entry = next;
+        }
+    }
+
+    pthread_rwlock_destroy(&directory->lock);
+    free(directory->buckets);
+    free(directory->entriesById);
+    free(directory);
+}
@@ -0,0 +1,37 @@
+#ifndef USER_DIRECTORY_UTILS_H
+#define USER_DIRECTORY_UTILS_H
+
+#include <pthread.h>
+
+typedef struct UserEntry
+{
+    int id;
+    char *username;
+    char *password;
+    struct UserEntry *next;
+} UserEntry;
+
+// Interned usernames: username -> id through a hash table, id -> username through an array.
+// Existence, login and count checks are served from here without touching the DB.
+// Entries are never removed, so the usernames handed out stay valid for the directory's lifetime.
+typedef struct UserDirectory
+{
+    UserEntry **buckets;
+    int bucketsCount;
+
+    UserEntry **entriesById;
+    int entriesByIdCapacity;
+
+    int usersCount;
+    pthread_rwlock_t lock;
+} UserDirectory;
+
+UserDirectory *CreateUserDirectory();
+int AddUser(UserDirectory *directory, int id, const char *username, const char *password);
+int FindUserId(UserDirectory *directory, const char *username);
+int AuthenticateUser(UserDirectory *directory, const char *username, const char *password);
+int GetDirectoryUsersCount(UserDirectory *directory);
+const char *FindUsername(UserDirectory *directory, int id);
+void FreeUserDirectory(UserDirectory *directory);
+
+#endif
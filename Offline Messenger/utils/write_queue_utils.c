@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "write_queue_utils.h"
+
+// Waits for a full batch, but not past the deadline of the oldest queued write.
+static void WaitForBatch(WriteQueue *queue)
+{
+    struct timespec deadline = queue->queue[queue->queueHead].queuedAt;
+    deadline.tv_nsec += (long)queue->batchDelayMicroseconds * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    while (queue->queueLength < queue->batchSize && !queue->stopping)
+    {
+        if (pthread_cond_timedwait(&queue->writeQueued, &queue->mutex, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+}
+
+static void *RunWriter(void *arg)
+{
+    WriteQueue *queue = (WriteQueue *)arg;
+
+    while (1)
+    {
+        pthread_mutex_lock(&queue->mutex);
+        while (queue->queueLength == 0 && !queue->stopping)
+        {
+            pthread_cond_wait(&queue->writeQueued, &queue->mutex);
+        }
+
+        if (queue->queueLength == 0 && queue->stopping)
+        {
+            pthread_mutex_unlock(&queue->mutex);
+            break;
+        }
+
+        WaitForBatch(queue);
+
+        int batchLength = queue->queueLength < queue->batchSize ? queue->queueLength : queue->batchSize;
+        for (int i = 0; i < batchLength; i++)
+        {
+            queue->batch[i] = queue->queue[queue->queueHead];
+            queue->messages[i] = queue->batch[i].message;
+            queue->queueHead = (queue->queueHead + 1) % queue->queueCapacity;
+        }
+        queue->queueLength -= batchLength;
+        pthread_mutex_unlock(&queue->mutex);
+
+        InsertMessagesBatch(queue->connection, queue->messages, batchLength);
+
+        // Requests are answered only once their batch is committed.
+        for (int i = 0; i < batchLength; i++)
+        {
+            queue->batch[i].completed(queue->batch[i].context, &queue->messages[i]);
+        }
+    }
+
+    return NULL;
+}
+
+WriteQueue *CreateWriteQueue(DatabaseConnection *connection, int queueCapacity, int batchSize, int batchDelayMicroseconds)
+{
+    if (queueCapacity <= 0 || batchSize <= 0 || batchDelayMicroseconds < 0)
+    {
+        return NULL;
+    }
+
+    WriteQueue *queue = (WriteQueue *)calloc(1, sizeof(WriteQueue));
+    if (queue == NULL)
+    {
+        return NULL;
+    }
+
+    queue->connection = connection;
+    queue->queueCapacity = queueCapacity;
+    queue->batchSize = batchSize;
+    queue->batchDelayMicroseconds = batchDelayMicroseconds;
+    queue->queue = (PendingWrite *)malloc(queueCapacity * sizeof(PendingWrite));
+    queue->batch = (PendingWrite *)malloc(batchSize * sizeof(PendingWrite));
+    queue->messages = (QueuedMessage *)malloc(batchSize * sizeof(QueuedMessage));
+
+    pthread_condattr_t condAttributes;
+    pthread_condattr_init(&condAttributes);
+    pthread_condattr_setclock(&condAttributes, CLOCK_MONOTONIC);
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->writeQueued, &condAttributes);
+    pthread_condattr_destroy(&condAttributes);
+
+    if (queue->queue == NULL || queue->batch == NULL || queue->messages == NULL)
+    {
+        DestroyWriteQueue(queue);
+        return NULL;
+    }
+
+    int threadCreationResult = pthread_create(&queue->thread, NULL, &RunWriter, queue);
+    if (threadCreationResult != 0)
+    {
+        printf("[Error][WriteQueue] Failed to create writer: %s\n", strerror(threadCreationResult));
+        fflush(stdout);
+        DestroyWriteQueue(queue);
+        return NULL;
+    }
+    queue->threadStarted = 1;
+
+    return queue;
+}
+
+// The message is not copied, it must stay valid until the completed callback runs.
+// Never blocks: a full queue rejects the write so the caller can answer "busy" right away.
+int QueueMessageInsert(WriteQueue *queue, int senderId, int receiverId, const char *message, int replyId,
+                       WriteCompleted completed, void *context)
+{
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->stopping || queue->queueLength == queue->queueCapacity)
+    {
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+
+    PendingWrite *write = &queue->queue[(queue->queueHead + queue->queueLength) % queue->queueCapacity];
+    write->message.senderId = senderId;
+    write->message.receiverId = receiverId;
+    write->message.message = message;
+    write->message.replyId = replyId;
+    write->message.result = -1;
+    write->completed = completed;
+    write->context = context;
+    clock_gettime(CLOCK_MONOTONIC, &write->queuedAt);
+    queue->queueLength++;
+
+    // The writer only needs waking for its first write and for a full batch.
+    if (queue->queueLength == 1 || queue->queueLength == queue->batchSize)
+    {
+        pthread_cond_signal(&queue->writeQueued);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    return 0;
+}
+
+void DestroyWriteQueue(WriteQueue *queue)
+{
+    if (queue == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->writeQueued);
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (queue->threadStarted)
+    {
+        pthread_join(queue->thread, NULL);
+    }
+
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->writeQueued);
+    free(queue->queue);
+    free(queue->batch);
+    free(queue->messages);
+    free(queue);
+}
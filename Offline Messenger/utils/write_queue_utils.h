@@ -0,0 +1,46 @@
+#ifndef WRITE_QUEUE_UTILS_H
+#define WRITE_QUEUE_UTILS_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "database_utils.h"
+
+// Called with the message once its batch is committed; message->result is 0 when it was inserted.
+typedef void (*WriteCompleted)(void *context, const QueuedMessage *message);
+
+typedef struct PendingWrite
+{
+    QueuedMessage message;
+    WriteCompleted completed;
+    void *context;
+    struct timespec queuedAt;
+} PendingWrite;
+
+typedef struct WriteQueue
+{
+    DatabaseConnection *connection;
+    pthread_t thread;
+    int threadStarted;
+
+    PendingWrite *queue;
+    int queueCapacity;
+    int queueHead;
+    int queueLength;
+
+    PendingWrite *batch;
+    QueuedMessage *messages;
+    int batchSize;
+    int batchDelayMicroseconds;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t writeQueued;
+    int stopping;
+} WriteQueue;
+
+WriteQueue *CreateWriteQueue(DatabaseConnection *connection, int queueCapacity, int batchSize, int batchDelayMicroseconds);
+int QueueMessageInsert(WriteQueue *queue, int senderId, int receiverId, const char *message, int replyId,
+                       WriteCompleted completed, void *context);
+void DestroyWriteQueue(WriteQueue *queue);
+
+#endif